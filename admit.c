@@ -0,0 +1,106 @@
+#include "admit.h"
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+//Bounds of the retry hint sent with RES_BUSY
+#define ADMIT_MIN_RETRY_MS 10
+#define ADMIT_MAX_RETRY_MS 1000
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+//Current accept queue length of a listening socket (tcpi_unacked on a listener)
+static int queue_depth(int listen_fd) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    return getsockopt(listen_fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 ? (int)info.tcpi_unacked : 0;
+}
+
+/*
+Folds how long an accepted session waited in the accept queue into the moving
+average, and returns the new average in microseconds. The wait is the time since
+the client's login (or handshake) arrived, in jiffies resolution.
+ */
+static long long record_wait(Bank *bank, int sock) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    long long wait_us = getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 ? info.tcpi_last_data_recv * 1000LL : 0;
+    //1/8 weight; concurrent updates may lose a sample, which is harmless
+    long long avg = bank->admit_wait_us;
+    avg += (wait_us - avg) / 8;
+    bank->admit_wait_us = avg;
+    return avg;
+}
+
+//Counts a shed session and returns the retry hint: roughly how long the queue takes to drain
+static int shed(Bank *bank, long long avg_wait_us) {
+    __sync_fetch_and_add(&bank->admit_shed_sessions, 1);
+    long long retry_ms = avg_wait_us / 1000;
+    if (retry_ms < ADMIT_MIN_RETRY_MS) retry_ms = ADMIT_MIN_RETRY_MS;
+    if (retry_ms > ADMIT_MAX_RETRY_MS) retry_ms = ADMIT_MAX_RETRY_MS;
+    return retry_ms;
+}
+
+/*
+Decides whether a session just accepted from 'listen_fd' may log in.
+Two signals are used: the accept queue depth (connections still waiting
+behind this one) and a moving average of how long sessions waited in that
+queue before a worker picked them up, which is where latency grows once the
+workers are saturated. Shedding early keeps that queue, and so the latency of
+admitted sessions, bounded instead of letting clients wait out their timeout.
+Returns 0 to admit, or the suggested retry delay in ms if the session is shed.
+ */
+int admit_session(Bank *bank, const AdmitConfig *cfg, int listen_fd, int sock) {
+    if (cfg->max_queue <= 0 && cfg->max_wait_ms <= 0) return 0;
+    int depth = queue_depth(listen_fd);
+    long long avg = record_wait(bank, sock);
+    int overloaded = (cfg->max_queue > 0 && depth > cfg->max_queue) ||
+                     (cfg->max_wait_ms > 0 && avg > cfg->max_wait_ms * 1000LL);
+    return overloaded ? shed(bank, avg) : 0;
+}
+
+/*
+Workers only check admission when they accept, so while every worker is busy
+with a long session nobody would. The shedder process polls the queue instead:
+returns 1 if it holds more than max_queue sessions, counting 'held' sessions the
+caller already accepted from it. The caller then accepts the oldest one, checks
+again with held = 1 (workers may have drained the queue meanwhile) and only
+then rejects it with admit_reject().
+ */
+int admit_queue_full(const AdmitConfig *cfg, int listen_fd, int held) {
+    return cfg->max_queue > 0 && queue_depth(listen_fd) + held > cfg->max_queue;
+}
+
+//Records a session rejected by the shedder; returns its retry hint in ms
+int admit_reject(Bank *bank, int sock) {
+    return shed(bank, record_wait(bank, sock));
+}
+
+/*
+Per-account rate limit (generic cell rate algorithm): one timestamp per account
+records when its next request conforms. Requests may run ahead of the rate by up
+to one second's worth before being rejected.
+Returns 0 to admit, or the number of ms until the account may send again.
+ */
+int admit_request(Bank *bank, const AdmitConfig *cfg, Account *a) {
+    if (cfg->rate <= 0 || a == NULL) return 0;
+    long long interval = 1000000000LL / cfg->rate;
+    long long tolerance = interval * (cfg->rate - 1);
+    long long now = now_ns();
+
+    pthread_mutex_lock(&a->lock);
+    long long tat = a->rate_tat_ns > now ? a->rate_tat_ns : now;
+    if (tat - now > tolerance) {
+        pthread_mutex_unlock(&a->lock);
+        __sync_fetch_and_add(&bank->admit_shed_requests, 1);
+        return (tat - now - tolerance + 999999) / 1000000;
+    }
+    a->rate_tat_ns = tat + interval;
+    pthread_mutex_unlock(&a->lock);
+    return 0;
+}
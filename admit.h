@@ -0,0 +1,17 @@
+#ifndef ADMIT_H
+#define ADMIT_H
+#include "models.h"
+
+//Admission thresholds (0 disables a check)
+typedef struct {
+    int max_queue;   //Shed new sessions while more than this many wait in the accept queue
+    int max_wait_ms; //Shed new sessions while the average accept-queue wait exceeds this
+    int rate;        //Requests per second per account (bursts of up to one second's worth)
+} AdmitConfig;
+
+int admit_session(Bank *bank, const AdmitConfig *cfg, int listen_fd, int sock);
+int admit_queue_full(const AdmitConfig *cfg, int listen_fd, int held);
+int admit_reject(Bank *bank, int sock);
+int admit_request(Bank *bank, const AdmitConfig *cfg, Account *a);
+
+#endif
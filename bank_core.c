@@ -1,14 +1,92 @@
 #include "bank_core.h"
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+//Below this many accounts per thread, parallel initialization is not worth the thread start-up
+#define MIN_ACCOUNTS_PER_THREAD 65536
+
+//Size in bytes of a Bank holding 'num_accounts' accounts
+size_t bank_size(int num_accounts) {
+    return sizeof(Bank) + (size_t)num_accounts * sizeof(Account);
+}
+
+/*
+Maps shared memory for a Bank of 'num_accounts' accounts.
+With 'huge_pages', first tries an anonymous shared MAP_HUGETLB mapping (2 MiB pages,
+inherited by the forked workers) to cut TLB misses on large ledgers. If no huge
+pages are reserved (vm.nr_hugepages), it falls back to the regular named POSIX
+shared memory and asks for transparent huge pages instead.
+Sets *used_huge to 1 if MAP_HUGETLB succeeded. Returns NULL on failure.
+ */
+Bank *bank_map(const char *shm_name, int num_accounts, int huge_pages, int *used_huge) {
+    size_t size = bank_size(num_accounts);
+    *used_huge = 0;
+
+    if (huge_pages) {
+        size_t huge_size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        void *p = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            *used_huge = 1;
+            return p;
+        }
+    }
+
+    //Create or open the shared memory object and set its size
+    int fd = shm_open(shm_name, O_CREAT | O_RDWR, 0666);
+    if (fd < 0) return NULL;
+    if (ftruncate(fd, size) == -1) { close(fd); return NULL; }
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return NULL;
+    if (huge_pages) madvise(p, size, MADV_HUGEPAGE); //Best effort: depends on shmem_enabled
+    return p;
+}
+
+//One thread's share of the account table during bank_init()
+typedef struct {
+    Bank *bank;
+    const long long *balances;
+    pthread_mutexattr_t *attr;
+    int begin, end;
+} InitSlice;
+
+static void *init_slice(void *arg) {
+    InitSlice *slice = arg;
+    Bank *bank = slice->bank;
+    for (int i = slice->begin; i < slice->end; i++) {
+        bank->accounts[i].id = bank->first_id + i;
+        bank->accounts[i].balance = slice->balances ? slice->balances[i] : INITIAL_BALANCE;
+        bank->accounts[i].rate_tat_ns = 0;
+        /*
+        Initialize Row-Level Lock for each account.
+        This allows high concurrency: locking Account A doesn't block Account B.
+        */
+        pthread_mutex_init(&bank->accounts[i].lock, slice->attr);
+    }
+    return NULL;
+}
 
 /*
 Initializes the Bank structure in Shared Memory.
 This function sets up the initial state of accounts and, crucially,
 initializes the synchronization primitives (mutexes) to be process-shared.
+'balances' holds the starting balance of each account (NULL = INITIAL_BALANCE for all).
+Large ledgers are initialized by up to 'threads' threads, each owning a contiguous
+slice, so page faults and lock setup are spread across cores.
  */
-void bank_init(Bank *bank) {
+void bank_init(Bank *bank, int first_id, int num_accounts, const long long *balances, int threads) {
     //Reset global performance statistics
     bank->total_tx_count = 0;
     bank->total_latency_ns = 0;
+    bank->next_txid = 0;
+
+    //Record which slice of the global account space this shard owns
+    bank->first_id = first_id;
+    bank->num_accounts = num_accounts;
 
     //Initialize mutex attributes
     pthread_mutexattr_t attr;
@@ -25,15 +103,50 @@ void bank_init(Bank *bank) {
     //Initialize global locks using the shared attribute
     pthread_mutex_init(&bank->global_lock, &attr); //Protects global stats
     pthread_mutex_init(&bank->log_lock, &attr); //Protects file I/O for logging
+    pthread_mutex_init(&bank->repl_lock, &attr); //Protects the replication ring
+    pthread_mutex_init(&bank->tx_lock, &attr); //Protects the 2PC prepared transactions
+    bank->tx_clock = 0;
+    memset(bank->prepared_tx, 0, sizeof(bank->prepared_tx));
 
-    //Initialize all accounts
-    for (int i = 0; i < MAX_ACCOUNTS; i++) {
-        bank->accounts[i].id = i;
-        bank->accounts[i].balance = 1000; //Set initial balance
-        /*
-        Initialize Row-Level Lock for each account.
-        This allows high concurrency: locking Account A doesn't block Account B.
-        */
-        pthread_mutex_init(&bank->accounts[i].lock, &attr);
+    pthread_condattr_t cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&bank->repl_cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+    bank->repl_head = 0;
+    bank->repl_primary_seq = 0;
+    bank->repl_last_contact_ns = 0;
+    bank->repl_followers = 0;
+    bank->repl_waiters = 0;
+    for (int i = 0; i < REPL_MAX_FOLLOWERS; i++) bank->repl_sent[i] = -1;
+    bank->read_only = 0;
+    bank->admit_wait_us = 0;
+    bank->admit_shed_sessions = 0;
+    bank->admit_shed_requests = 0;
+
+    //Initialize all accounts in parallel slices
+    if (threads > num_accounts / MIN_ACCOUNTS_PER_THREAD) threads = num_accounts / MIN_ACCOUNTS_PER_THREAD;
+    if (threads < 1) threads = 1;
+    pthread_t tids[threads];
+    InitSlice slices[threads];
+    for (int t = 0; t < threads; t++) {
+        slices[t] = (InitSlice){ bank, balances, &attr,
+                                 (int)((long long)num_accounts * t / threads),
+                                 (int)((long long)num_accounts * (t + 1) / threads) };
+        if (t > 0) pthread_create(&tids[t], NULL, init_slice, &slices[t]);
     }
-}
\ No newline at end of file
+    init_slice(&slices[0]); //The calling thread takes the first slice
+    for (int t = 1; t < threads; t++) pthread_join(tids[t], NULL);
+
+    pthread_mutexattr_destroy(&attr);
+}
+
+/*
+Maps a global account ID to the local Account slot.
+Returns NULL if the ID is not owned by this shard.
+ */
+Account *bank_account(Bank *bank, int id) {
+    int idx = id - bank->first_id;
+    if (idx < 0 || idx >= bank->num_accounts) return NULL;
+    return &bank->accounts[idx];
+}
@@ -1,7 +1,11 @@
 #ifndef BANK_CORE_H
 #define BANK_CORE_H
+#include <stddef.h>
 #include "models.h"
 
-void bank_init(Bank *bank);
+size_t bank_size(int num_accounts);
+Bank *bank_map(const char *shm_name, int num_accounts, int huge_pages, int *used_huge);
+void bank_init(Bank *bank, int first_id, int num_accounts, const long long *balances, int threads);
+Account *bank_account(Bank *bank, int id);
 
-#endif
\ No newline at end of file
+#endif
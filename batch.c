@@ -0,0 +1,105 @@
+#include "batch.h"
+#include "bank_core.h"
+#include "repl.h"
+#include <time.h>
+#include <unistd.h>
+
+//Accounts posted between two checks of the replication backlog
+#define BATCH_CHECK_EVERY 256
+
+//One partition of a batch job, run by its own thread
+typedef struct {
+    Bank *bank;
+    const BatchRule *rule;
+    BatchPartition *part;
+} BatchWork;
+
+//Balance change the rule makes to one account (0 = leave it alone).
+//Sets '*overflow' instead if the change cannot be computed or applied in 64 bits.
+static long long rule_delta(const BatchRule *rule, long long balance, int *overflow) {
+    long long delta = 0, scaled, result;
+    switch (rule->op) {
+        case OP_BATCH_RATE:
+            if (balance <= 0) break;
+            if (__builtin_mul_overflow(balance, rule->value, &scaled)) { *overflow = 1; return 0; }
+            delta = scaled / 10000;
+            break;
+        case OP_BATCH_FEE:   delta = balance >= rule->value ? -rule->value : 0; break;
+        case OP_BATCH_BONUS: delta = balance >= rule->threshold ? rule->value : 0; break;
+        default:             break;
+    }
+    if (__builtin_add_overflow(balance, delta, &result)) { *overflow = 1; return 0; }
+    return delta;
+}
+
+/*
+Applies the rule to every account of one partition.
+Each account's lock is held only while that account is updated, so live
+transfers on other accounts (and on this one, between updates) keep running.
+Every BATCH_CHECK_EVERY accounts the partition pauses while followers are more
+than half a ring behind: a job over millions of accounts would otherwise
+overwrite records before they are sent and force every follower to resync.
+ */
+static void *post_partition(void *arg) {
+    BatchWork *w = arg;
+    BatchPartition *part = w->part;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int id = part->first_id; id <= part->last_id; id++) {
+        if ((id - part->first_id) % BATCH_CHECK_EVERY == 0) {
+            while (repl_backlog(w->bank) > REPL_LOG_SIZE / 2) {
+                usleep(1000);
+                part->throttled_ms++;
+            }
+        }
+        Account *a = bank_account(w->bank, id);
+        pthread_mutex_lock(&a->lock);
+        int overflow = 0;
+        long long delta = rule_delta(w->rule, a->balance, &overflow);
+        if (delta != 0) {
+            a->balance += delta;
+            //Followers see the posting as an ordinary credit or debit
+            if (delta > 0) repl_append(w->bank, -1, id, delta);
+            else repl_append(w->bank, id, -1, -delta);
+        }
+        pthread_mutex_unlock(&a->lock);
+
+        part->processed++;
+        if (delta != 0) { part->posted++; part->net += delta; }
+        if (overflow) part->overflowed++;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    part->elapsed_ns = (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+    return NULL;
+}
+
+/*
+Runs a batch posting job over the part of [rule->first_id, rule->last_id] owned
+by this shard, split into up to 'partitions' contiguous partitions processed
+in parallel. Fills one summary per partition in 'parts'.
+Returns the number of partitions used (0 if the range does not overlap this shard).
+ */
+int batch_post(Bank *bank, const BatchRule *rule, int partitions, BatchPartition *parts) {
+    long long first = rule->first_id > bank->first_id ? rule->first_id : bank->first_id;
+    long long last = (long long)bank->first_id + bank->num_accounts - 1;
+    if (rule->last_id < last) last = rule->last_id;
+    if (first > last) return 0;
+
+    long long count = last - first + 1;
+    if (partitions > count) partitions = count;
+    if (partitions < 1) partitions = 1;
+
+    pthread_t tids[partitions];
+    BatchWork work[partitions];
+    for (int p = 0; p < partitions; p++) {
+        parts[p] = (BatchPartition){ (int)(first + count * p / partitions),
+                                     (int)(first + count * (p + 1) / partitions - 1), 0, 0, 0, 0, 0, 0 };
+        work[p] = (BatchWork){ bank, rule, &parts[p] };
+        if (p > 0) pthread_create(&tids[p], NULL, post_partition, &work[p]);
+    }
+    post_partition(&work[0]); //The calling thread takes the first partition
+    for (int p = 1; p < partitions; p++) pthread_join(tids[p], NULL);
+    return partitions;
+}
@@ -0,0 +1,7 @@
+#ifndef BATCH_H
+#define BATCH_H
+#include "models.h"
+
+int batch_post(Bank *bank, const BatchRule *rule, int partitions, BatchPartition *parts);
+
+#endif
@@ -7,36 +7,53 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <time.h>
+#include <sys/time.h>
 #include <signal.h>
 #include <netinet/tcp.h>
+#include <limits.h>
 //#include "bank_lib.h"
 #include "models.h"
 #include "protocol.h"
 #include "security.h"
 #include "bank_core.h"
+#include "shard.h"
+#include "loadgen.h"
 
 //Number of concurrent threads simulating users
 #define CLIENT_THREADS 100
-//Number of transactions each thread will perform
+//Number of transactions each thread will perform (override with -t)
 #define TX_PER_THREAD 1
+//Overload benchmark: sessions that may be in flight at once (override with -c)
+#define OVERLOAD_CONNECTIONS 15000
 
 //Global flag for graceful shutdown on SIGINT
 volatile sig_atomic_t stop_client = 0;
 //Global statistics for performance measurement
 long long total_tx_count = 0;
 long long total_latency_ns = 0;
+//Net money added by successful deposits/withdrawals (transfers must not change the total)
+long long net_external_flow = 0;
 //Mutex to protect statistics updates
 pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
 struct timespec start_time;
 
 //Local user structure for client simulation
 typedef struct {
+    int account_id;
     char username[LOGIN_USERNAME_LEN];
     char password[LOGIN_PASSWORD_LEN];
 } User;
 
 User users[CLIENT_THREADS];
 
+//Routing: which shard serves which account
+ShardMap shard_map;
+int tx_per_thread = TX_PER_THREAD;
+//-R: only send read-only balance queries (e.g. against a follower)
+int read_only_mode = 0;
+//-k: think time between a session's transactions in the event-driven modes
+int think_ms = 0;
+
 //Signal handler to stop client loop
 void handle_sigint(int sig) {
     (void)sig;
@@ -45,72 +62,51 @@ void handle_sigint(int sig) {
 
 //Thread function simulating a single client user
 void* client_task(void* arg) {
-    int my_id = *(int*)arg;
+    User *me = &users[*(int*)arg];
+    int my_id = me->account_id;
     free(arg);
 
-    struct sockaddr_in serv_addr;
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(PORT);
-    inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr);
+    //Route to the shard owning this user's account
+    int home = shard_for_account(&shard_map, my_id);
+    if (home < 0) {
+        printf("[User %02d] No shard owns this account\n", my_id);
+        return NULL;
+    }
+    ShardInfo *shard = &shard_map.shards[home];
+    int num_accounts = shard_map_total(&shard_map);
 
-    for (int i = 0; i < TX_PER_THREAD; i++) {
+    for (int i = 0; i < tx_per_thread; i++) {
         if (stop_client) break;
 
-        //Create TCP socket
-        int sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (sock < 0) continue;
-
-        //Connect to the server
-        if (connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-            close(sock);
+        //Connect and log in (High Security: AES)
+        int sock = shard_open_session(shard->host, shard->port, me->username, me->password);
+        if (sock == -1) {
             usleep(1000); //Retry backoff
             continue;
         }
-
-        //TCP Socket Options for performance and reliability
-        int keep = 1;
-        setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &keep, sizeof(keep));
-        int idle = 5, interval = 3, maxpkt = 3;
-        setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
-        setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
-        setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &maxpkt, sizeof(maxpkt));
-
-        struct timeval tv = {3, 0}; //3-second timeout for send/recv
-        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
-
-        //Login Phase (High Security: AES)
-        LoginRequest login_req = {0};
-        strcpy(login_req.username, users[my_id].username);
-        strcpy(login_req.password, users[my_id].password);
-
-        //Encrypt credentials using AES-128-CBC
-        unsigned char enc_login_req[sizeof(LoginRequest)] = {0};
-        aes_encrypt(&login_req, enc_login_req, sizeof(LoginRequest));
-        send_packet(sock, enc_login_req, sizeof(LoginRequest));
-
-        //Receive and decrypt login response
-        unsigned char enc_login_res[sizeof(LoginResponse)] = {0};
-        int ret = recv_packet(sock, enc_login_res, sizeof(LoginResponse));
-
-        LoginResponse login_res = {0};
-        aes_decrypt(enc_login_res, &login_res, sizeof(LoginResponse));
-
-        if (ret <= 0 || login_res.success != 1) {
-            printf("[User %02d] Login Failed: %s\n", my_id, login_res.msg);
-            close(sock);
+        if (sock == -3) {
+            printf("[User %02d] 伺服器忙碌, 稍後重試\n", my_id);
+            usleep(10000); //Shed by admission control: back off longer
+            continue;
+        }
+        if (sock < 0) {
+            printf("[User %02d] Login Failed\n", my_id);
             continue;
         }
 
         //Random Operation Phase (Efficiency: XOR)
         Request req = {0};
         //Randomly choose op: 0=Transfer, 1=Deposit, 2=Withdraw
-        int op_type = rand() % 3;  
+        //(a one-account map has no one to transfer to)
+        int op_type = num_accounts > 1 ? rand() % 3 : 1 + rand() % 2;
 
-        if (op_type == 0) {
+        if (read_only_mode) {
+            req.op = OP_BALANCE;
+        } else if (op_type == 0) {
             req.op = OP_TRANSFER;
+            //Pick by index through the shard map: account IDs need not start at 0 or be contiguous
             do {
-                req.dst_id = rand() % MAX_ACCOUNTS;
+                req.dst_id = shard_nth_account(&shard_map, rand() % num_accounts);
             } while (req.dst_id == my_id);
             req.amount = (rand() % 100) + 1;
         } else if (op_type == 1) {
@@ -139,7 +135,7 @@ void* client_task(void* arg) {
         }
 
         Response res = {0};
-        ret = recv_packet(sock, &res, sizeof(Response));
+        int ret = recv_packet(sock, &res, sizeof(Response));
 
         if (ret > 0) {
             
@@ -156,6 +152,8 @@ void* client_task(void* arg) {
             pthread_mutex_lock(&stats_lock);
             total_tx_count++;
             total_latency_ns += latency_ns;
+            if (res.status == RES_OK && real_op == OP_DEPOSIT) net_external_flow += print_amt;
+            if (res.status == RES_OK && real_op == OP_WITHDRAW) net_external_flow -= print_amt;
             pthread_mutex_unlock(&stats_lock);
 
             if (res.status == RES_OK) {
@@ -168,6 +166,9 @@ void* client_task(void* arg) {
                 else if (real_op == OP_WITHDRAW)
                     printf("[User %02d] 提款成功！ Acc %02d ($%d)\n",
                            my_id, print_src, print_amt);
+                else if (real_op == OP_BALANCE)
+                    printf("[User %02d] 餘額查詢 Acc %02d: $%lld\n",
+                           my_id, print_src, res.balance);
             } else {
                 printf("[User %02d] 操作失敗: %s\n", my_id, res.msg);
             }
@@ -180,6 +181,107 @@ void* client_task(void* arg) {
     return NULL;
 }
 
+//Sums the balances of every shard through the peer port. Returns -1 if a shard is unreachable.
+long long audit_total_assets() {
+    long long total = 0;
+    for (int i = 0; i < shard_map.n; i++) {
+        ShardInfo *s = &shard_map.shards[i];
+        int sock = shard_open_session(s->host, s->port + PEER_PORT_OFFSET, ADMIN_USERNAME, ADMIN_PASSWORD);
+        if (sock < 0) return -1;
+        Request req = { .op = OP_AUDIT };
+        Response res = {0};
+        int ok = shard_call(sock, &req, &res) == 0 && res.status == RES_OK;
+        close(sock);
+        if (!ok) return -1;
+        total += res.balance;
+    }
+    return total;
+}
+
+/*
+Conservation check: total assets may only have changed by 'net_flow', the money
+added by successful deposits and withdrawals. Prints the result and returns 1 if
+it holds, 0 on MISMATCH or if either audit failed (a shard was unreachable).
+ */
+int check_assets(long long before, long long after, long long net_flow) {
+    if (before < 0 || after < 0) {
+        printf("資產核對: 稽核失敗 (shard unreachable) -> MISMATCH\n");
+        return 0;
+    }
+    long long expected = before + net_flow;
+    printf("資產核對: 交易前 $%lld, 交易後 $%lld, 預期 $%lld -> %s\n",
+           before, after, expected, after == expected ? "OK" : "MISMATCH");
+    return after == expected;
+}
+
+//Prints each shard's replication status (role, sequence number, lag) and total assets.
+//Returns 0 if every shard answered.
+int print_repl_status() {
+    int failed = 0;
+    for (int i = 0; i < shard_map.n; i++) {
+        ShardInfo *s = &shard_map.shards[i];
+        int sock = shard_open_session(s->host, s->port + PEER_PORT_OFFSET, ADMIN_USERNAME, ADMIN_PASSWORD);
+        Request req = { .op = OP_STATUS }, audit = { .op = OP_AUDIT };
+        Response res = {0}, total = {0};
+        if (sock >= 0 && shard_call(sock, &req, &res) == 0 && shard_call(sock, &audit, &total) == 0 &&
+            total.status == RES_OK) {
+            printf("[%s:%d] %s total=%lld\n", s->host, s->port, res.msg, total.balance);
+        } else {
+            printf("[%s:%d] unreachable\n", s->host, s->port);
+            failed = 1;
+        }
+        if (sock >= 0) close(sock);
+    }
+    return failed;
+}
+
+/*
+Runs a batch posting job on every shard: spec is "rate:<bp>", "fee:<amount>" or
+"bonus:<amount>:<min balance>", optionally followed by "@first-last".
+Returns 0 if every shard completed its part.
+ */
+int run_batch(const char *spec) {
+    char type[16];
+    long long value = 0, threshold = 0;
+    int first = 0, last = 0x7fffffff, consumed = 0;
+    if (sscanf(spec, "%15[a-z]:%lld%n", type, &value, &consumed) != 2) return -1;
+    const char *rest = spec + consumed;
+    if (*rest == ':') {
+        if (sscanf(rest, ":%lld%n", &threshold, &consumed) != 1) return -1;
+        rest += consumed;
+    }
+    if (*rest == '@' && sscanf(rest, "@%d-%d", &first, &last) != 2) return -1;
+    //The rule value travels in Request.amount (an int): refuse what would be truncated
+    if (value < 0 || value > INT_MAX) return -1;
+
+    Request req = { .src_id = first, .dst_id = last, .amount = value, .param = threshold };
+    if (strcmp(type, "rate") == 0) req.op = OP_BATCH_RATE;
+    else if (strcmp(type, "fee") == 0) req.op = OP_BATCH_FEE;
+    else if (strcmp(type, "bonus") == 0) req.op = OP_BATCH_BONUS;
+    else return -1;
+
+    int failed = 0;
+    long long net = 0;
+    for (int i = 0; i < shard_map.n; i++) {
+        ShardInfo *s = &shard_map.shards[i];
+        int sock = shard_open_session(s->host, s->port + PEER_PORT_OFFSET, ADMIN_USERNAME, ADMIN_PASSWORD);
+        Response res = {0};
+        //A job over millions of accounts can outlast the default 3s receive timeout
+        struct timeval tv = {0, 0};
+        if (sock >= 0) setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (sock >= 0 && shard_call(sock, &req, &res) == 0 && res.status == RES_OK) {
+            printf("[%s:%d] 批次完成: %s, 淨額 $%lld\n", s->host, s->port, res.msg, res.balance);
+            net += res.balance;
+        } else {
+            printf("[%s:%d] 批次失敗: %s\n", s->host, s->port, sock >= 0 ? res.msg : "unreachable");
+            failed = 1;
+        }
+        if (sock >= 0) close(sock);
+    }
+    printf("批次總淨額: $%lld\n", net);
+    return failed ? 1 : 0;
+}
+
 void print_global_stats() {
     struct timespec end_time;
     clock_gettime(CLOCK_MONOTONIC, &end_time);
@@ -203,7 +305,131 @@ void print_global_stats() {
     pthread_mutex_unlock(&stats_lock);
 }
 
-int main() {
+/*
+Event-driven mode (-E): a few epoll threads drive 'connections' concurrent
+sessions instead of one OS thread per user. Each session logs in once and
+sends tx_per_thread transactions.
+ */
+int run_event_engine(int threads, int connections) {
+    LoadConfig cfg = { .map = &shard_map, .connections = connections, .threads = threads,
+                       .tx_per_session = tx_per_thread, .read_only = read_only_mode,
+                       .think_ms = think_ms, .stop = &stop_client };
+    LoadStats *stats = malloc(sizeof(LoadStats));
+    long long assets_before = audit_total_assets();
+
+    printf("========================================\n");
+    printf("[System] 事件驅動模式: %d 條連線, %d 個執行緒, 每條 %d 筆交易\n", connections, threads, tx_per_thread);
+    printf("========================================\n");
+    int used = loadgen_run(&cfg, stats);
+    if (used < 0) { free(stats); return 1; }
+    if (used < connections) printf("[System] 檔案描述符上限不足, 連線數降為 %d\n", used);
+
+    printf("\n========== [Client 統計] ==========\n");
+    printf("登入成功/失敗: %lld / %lld, 連線錯誤: %lld\n", stats->sessions, stats->login_failed, stats->io_errors);
+    printf("總交易筆數: %lld (成功 %lld, 過載拒絕 %lld)\n", stats->tx_count, stats->tx_ok, stats->busy);
+    if (stats->tx_count > 0) {
+        printf("平均延遲: %.3f ms\n", (double)stats->total_latency_ns / stats->tx_count / 1e6);
+        printf("p50 延遲: %.3f ms, p99 延遲: %.3f ms\n",
+               loadgen_percentile_ms(stats, 50), loadgen_percentile_ms(stats, 99));
+    }
+    printf("整體 Throughput (TPS): %.2f 交易/秒\n", stats->elapsed_sec > 0 ? stats->tx_count / stats->elapsed_sec : 0);
+    printf("總耗時: %.3f 秒\n", stats->elapsed_sec);
+    printf("===================================\n");
+
+    long long assets_after = audit_total_assets();
+    int ok = check_assets(assets_before, assets_after, stats->net_flow);
+    free(stats);
+    return ok ? 0 : 1;
+}
+
+/*
+Overload benchmark (-O): offers sessions at fixed rates (open loop), from
+'from' to 'to' sessions/sec in steps of 'step', each sending -t transactions
+-k ms apart, and prints goodput and the latency of accepted requests at each
+rate. A session's first request is timed from its arrival, so queueing at the
+server is included. Run it against a server with and without admission control
+(-Q/-W) to see whether goodput and p99 hold up past capacity.
+ */
+int run_overload_benchmark(int threads, int connections, double from, double to, double step, double seconds) {
+    LoadStats *stats = malloc(sizeof(LoadStats));
+    printf("========================================\n");
+    printf("[System] 過載測試: 每秒 %.0f ~ %.0f 個連線 (每條 %d 筆交易, 間隔 %d ms), 每段 %.0f 秒, 最多 %d 條同時連線\n",
+           from, to, tx_per_thread, think_ms, seconds, connections);
+    printf("========================================\n");
+    printf("%10s %12s %10s %10s %10s %10s\n", "提供負載/s", "有效吞吐/s", "p50 ms", "p99 ms", "拒絕率", "錯誤");
+    for (double rate = from; rate <= to + 1e-9 && !stop_client; rate += step) {
+        LoadConfig cfg = { .map = &shard_map, .connections = connections, .threads = threads,
+                           .tx_per_session = tx_per_thread, .read_only = read_only_mode, .think_ms = think_ms,
+                           .rate = rate, .duration_sec = seconds, .stop = &stop_client };
+        if (loadgen_run(&cfg, stats) < 0) { free(stats); return 1; }
+        double offered = stats->arrivals > 0 ? stats->arrivals : 1;
+        printf("%10.0f %12.0f %10.3f %10.3f %9.1f%% %10lld\n", rate,
+               stats->elapsed_sec > 0 ? stats->tx_ok / stats->elapsed_sec : 0,
+               loadgen_percentile_ms(stats, 50), loadgen_percentile_ms(stats, 99),
+               100.0 * stats->busy / offered, stats->io_errors + stats->overflow);
+        sleep(1); //Let the server drain between steps
+    }
+    free(stats);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    //Options: -m <shard map> (same as the servers'), -t <transactions per thread>,
+    //-R read-only balance queries, -s print replication status and exit,
+    //-b <rule> run a batch posting job (interest, fee or bonus) and exit,
+    //-E <threads> event-driven mode with -c <connections> concurrent sessions,
+    //-O <from>[:<to>:<step>] overload benchmark at those sessions/sec (with -E, -c, -d <seconds>),
+    //-k <ms> think time between transactions of a session (-E and -O)
+    const char *map_spec = DEFAULT_SHARD_MAP;
+    const char *batch_spec = NULL;
+    int event_threads = 0, connections = 0;
+    double offer_from = 0, offer_to = 0, offer_step = 1, offer_seconds = 5;
+    int status_only = 0;
+    int c;
+    while ((c = getopt(argc, argv, "m:t:Rsb:E:c:O:d:k:")) != -1) {
+        switch (c) {
+            case 'm': map_spec = optarg; break;
+            case 't': tx_per_thread = atoi(optarg); break;
+            case 'R': read_only_mode = 1; break;
+            case 's': status_only = 1; break;
+            case 'b': batch_spec = optarg; break;
+            case 'E': event_threads = atoi(optarg); break;
+            case 'c': connections = atoi(optarg); break;
+            case 'O':
+                if (sscanf(optarg, "%lf:%lf:%lf", &offer_from, &offer_to, &offer_step) != 3) {
+                    offer_to = offer_from;
+                    offer_step = 1;
+                }
+                break;
+            case 'd': offer_seconds = atof(optarg); break;
+            case 'k': think_ms = atoi(optarg); break;
+            default: break;
+        }
+    }
+    if (shard_map_parse(&shard_map, map_spec) != 0) {
+        fprintf(stderr, "Usage: %s [-m host:port:first:count,...] [-t tx_per_thread] [-R] [-s]"
+                        " [-b rate:<bp>|fee:<amt>|bonus:<amt>:<min>[@first-last]] [-E threads -c connections]"
+                        " [-O from[:to:step] -d seconds] [-k think_ms]\n", argv[0]);
+        return 1;
+    }
+    if (batch_spec) {
+        int ret = run_batch(batch_spec);
+        if (ret < 0) fprintf(stderr, "Invalid batch rule: %s\n", batch_spec);
+        return ret != 0;
+    }
+    if (offer_from > 0) {
+        signal(SIGINT, handle_sigint);
+        if (offer_step <= 0) offer_step = 1;
+        return run_overload_benchmark(event_threads > 0 ? event_threads : 1,
+                                      connections > 0 ? connections : OVERLOAD_CONNECTIONS,
+                                      offer_from, offer_to, offer_step, offer_seconds);
+    }
+    if (event_threads > 0) {
+        signal(SIGINT, handle_sigint);
+        return run_event_engine(event_threads, connections > 0 ? connections : CLIENT_THREADS);
+    }
+    if (status_only) return print_repl_status();
+
     setbuf(stdout, NULL);
     srand(time(NULL));
     signal(SIGINT, handle_sigint);
@@ -211,12 +437,16 @@ int main() {
 
     pthread_t threads[CLIENT_THREADS];
 
-    //Initialize mock user data
+    //Initialize mock user data: thread i logs in as the i-th account of the map
+    int total_accounts = shard_map_total(&shard_map);
     for (int i = 0; i < CLIENT_THREADS; i++) {
-        snprintf(users[i].username, LOGIN_USERNAME_LEN, "user%d", i);
-        snprintf(users[i].password, LOGIN_PASSWORD_LEN, "pass%d", i);
+        users[i].account_id = shard_nth_account(&shard_map, i % total_accounts);
+        snprintf(users[i].username, LOGIN_USERNAME_LEN, "user%d", users[i].account_id);
+        snprintf(users[i].password, LOGIN_PASSWORD_LEN, "pass%d", users[i].account_id);
     }
 
+    long long assets_before = audit_total_assets();
+
     printf("========================================\n");
     printf("[System] 交易中...\n");
     printf("========================================\n");
@@ -234,7 +464,11 @@ int main() {
 
     print_global_stats();
 
+    //Conservation check: only deposits and withdrawals may change total assets
+    long long assets_after = audit_total_assets();
+    int ok = check_assets(assets_before, assets_after, net_external_flow);
+
     printf("\n========================================\n");
     printf("[System] 交易結束。\n");
-    return 0;
+    return ok ? 0 : 1;
 }
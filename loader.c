@@ -0,0 +1,167 @@
+#include "loader.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//One thread's share of a CSV account file
+typedef struct {
+    const char *begin, *end;
+    int first_id, count;  //Range to keep (pass 2)
+    long long *balances;  //Output, indexed from first_id (pass 2)
+    int min_id, max_id;   //Range seen in this chunk (pass 1)
+} ParseChunk;
+
+//Parses one integer from [*p, end) and advances *p. Returns 0 if there were no digits.
+static int parse_ll(const char **p, const char *end, long long *out) {
+    const char *s = *p;
+    while (s < end && (*s == ' ' || *s == '\t')) s++;
+    int neg = 0;
+    if (s < end && (*s == '-' || *s == '+')) neg = (*s++ == '-');
+    const char *digits = s;
+    long long v = 0;
+    while (s < end && *s >= '0' && *s <= '9') v = v * 10 + (*s++ - '0');
+    if (s == digits) return 0;
+    *out = neg ? -v : v;
+    *p = s;
+    return 1;
+}
+
+//Parses the line starting at *p as "id,balance" and moves *p to the next line.
+//Returns 0 for lines that do not match (e.g. a header).
+static int parse_line(const char **p, const char *end, long long *id, long long *balance) {
+    const char *s = *p;
+    int ok = parse_ll(&s, end, id) && s < end && *s++ == ',' && parse_ll(&s, end, balance);
+    while (s < end && *s != '\n') s++;
+    *p = s < end ? s + 1 : end;
+    return ok;
+}
+
+//Pass 1: smallest and largest ID in the chunk
+static void *scan_chunk(void *arg) {
+    ParseChunk *c = arg;
+    c->min_id = INT_MAX;
+    c->max_id = -1;
+    long long id, balance;
+    for (const char *p = c->begin; p < c->end; ) {
+        if (!parse_line(&p, c->end, &id, &balance) || id < 0 || id > INT_MAX) continue;
+        if (id < c->min_id) c->min_id = id;
+        if (id > c->max_id) c->max_id = id;
+    }
+    return NULL;
+}
+
+//Pass 2: store the balances that fall inside the shard's range
+static void *parse_chunk(void *arg) {
+    ParseChunk *c = arg;
+    long long id, balance;
+    for (const char *p = c->begin; p < c->end; ) {
+        if (!parse_line(&p, c->end, &id, &balance)) continue;
+        long long idx = id - c->first_id;
+        if (idx >= 0 && idx < c->count) c->balances[idx] = balance;
+    }
+    return NULL;
+}
+
+//Runs fn over every chunk, one thread each (the calling thread takes chunk 0)
+static void run_chunks(void *(*fn)(void *), ParseChunk *chunks, int n) {
+    pthread_t tids[n];
+    for (int t = 1; t < n; t++) pthread_create(&tids[t], NULL, fn, &chunks[t]);
+    fn(&chunks[0]);
+    for (int t = 1; t < n; t++) pthread_join(tids[t], NULL);
+}
+
+static long long *load_csv(const char *data, size_t size, int *first_id, int *count, int threads) {
+    //Split the file into one chunk per thread, cutting at line boundaries
+    if (threads < 1) threads = 1;
+    if ((size_t)threads > size / 4096 + 1) threads = size / 4096 + 1;
+    ParseChunk chunks[threads];
+    const char *pos = data, *end = data + size;
+    for (int t = 0; t < threads; t++) {
+        const char *cut = (t == threads - 1) ? end : data + size * (t + 1) / threads;
+        if (cut < pos) cut = pos;
+        while (cut < end && cut[-1] != '\n') cut++;
+        chunks[t] = (ParseChunk){ .begin = pos, .end = cut };
+        pos = cut;
+    }
+
+    //Without a fixed range (no shard map), the file defines the ledger
+    if (*count <= 0) {
+        run_chunks(scan_chunk, chunks, threads);
+        int min_id = INT_MAX, max_id = -1;
+        for (int t = 0; t < threads; t++) {
+            if (chunks[t].min_id < min_id) min_id = chunks[t].min_id;
+            if (chunks[t].max_id > max_id) max_id = chunks[t].max_id;
+        }
+        if (max_id < 0) return NULL;
+        *first_id = min_id;
+        *count = max_id - min_id + 1;
+    }
+    if (*count > MAX_LEDGER_ACCOUNTS) return NULL;
+
+    long long *balances = calloc(*count, sizeof(long long));
+    if (!balances) return NULL;
+    for (int t = 0; t < threads; t++) {
+        chunks[t].first_id = *first_id;
+        chunks[t].count = *count;
+        chunks[t].balances = balances;
+    }
+    run_chunks(parse_chunk, chunks, threads);
+    return balances;
+}
+
+static long long *load_binary(const char *data, size_t size, int *first_id, int *count) {
+    const AccountFileHeader *hdr = (const AccountFileHeader *)data;
+    if (hdr->count < 0 || sizeof(*hdr) + (size_t)hdr->count * sizeof(long long) > size) return NULL;
+    const long long *file_balances = (const long long *)(data + sizeof(*hdr));
+
+    if (*count <= 0) {
+        *first_id = hdr->first_id;
+        *count = hdr->count;
+    }
+    if (*count <= 0 || *count > MAX_LEDGER_ACCOUNTS) return NULL;
+
+    long long *balances = calloc(*count, sizeof(long long));
+    if (!balances) return NULL;
+    //Copy the overlap between the file's range and the shard's range
+    long long lo = hdr->first_id > *first_id ? hdr->first_id : *first_id;
+    long long hi = (long long)hdr->first_id + hdr->count;
+    if ((long long)*first_id + *count < hi) hi = (long long)*first_id + *count;
+    if (lo < hi)
+        memcpy(&balances[lo - *first_id], &file_balances[lo - hdr->first_id], (hi - lo) * sizeof(long long));
+    return balances;
+}
+
+/*
+Reads an account file into an array of starting balances indexed from *first_id.
+Binary files start with an AccountFileHeader; anything else is parsed as CSV
+lines "id,balance" (non-matching lines such as a header are skipped), split
+across 'threads' threads.
+If *count > 0 the range [*first_id, *first_id + *count) is fixed (this shard's
+slice of the map) and other IDs are ignored; otherwise the range comes from the
+file. Accounts missing from the file start at 0.
+Returns the malloc'd array, or NULL on error.
+ */
+long long *load_accounts(const char *path, int *first_id, int *count, int threads) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) { close(fd); return NULL; }
+    const char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+
+    long long *balances;
+    if ((size_t)st.st_size >= sizeof(AccountFileHeader) &&
+        memcmp(data, ACCOUNT_FILE_MAGIC, sizeof(((AccountFileHeader *)0)->magic)) == 0)
+        balances = load_binary(data, st.st_size, first_id, count);
+    else
+        balances = load_csv(data, st.st_size, first_id, count, threads);
+
+    munmap((void *)data, st.st_size);
+    return balances;
+}
@@ -0,0 +1,7 @@
+#ifndef LOADER_H
+#define LOADER_H
+#include "models.h"
+
+long long *load_accounts(const char *path, int *first_id, int *count, int threads);
+
+#endif
@@ -0,0 +1,437 @@
+#include "loadgen.h"
+#include "protocol.h"
+#include "security.h"
+#include "shard.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+//Largest frame a session exchanges (the Response); every other message is smaller
+#define FRAME_MAX (8 + sizeof(Response))
+//Source ports available per local address (the default ephemeral range is ~28k)
+#define PORTS_PER_ADDR 20000
+//A thread whose sessions are all connected but silent for this long gives up on them
+//(connects are left to the kernel's SYN retries: a full accept queue can delay them for a while)
+#define STALL_TIMEOUT_MS 10000
+
+enum { ST_CONNECTING, ST_SEND_LOGIN, ST_RECV_LOGIN, ST_SEND_TX, ST_RECV_TX, ST_THINK, ST_DONE };
+
+/*
+One simulated user. Kept small (128 bytes) so 100k sessions fit in a few MB:
+the frame being sent or received is the only buffer.
+ */
+typedef struct {
+    int fd;
+    int account_id;
+    int remaining;      //Transactions still to send on this session
+    unsigned char state;
+    unsigned char op;   //Operation in flight
+    unsigned short off; //Bytes of buf sent or received so far
+    int amount;
+    long long t_send;   //While thinking: when the next request is due
+    unsigned char buf[FRAME_MAX];
+    unsigned char watching; //0 = not in the epoll set, 1 = EPOLLIN, 2 = EPOLLOUT
+    unsigned char from_arrival; //t_send holds the session's arrival time (open loop)
+} Conn;
+
+//One event loop and the sessions it drives
+typedef struct {
+    const LoadConfig *cfg;
+    struct sockaddr_in *dest; //Per shard
+    int first_conn, count;
+    int epfd;
+    int active;     //Sessions with an open socket
+    int connecting; //Of which still waiting for the TCP handshake
+    unsigned int seed;
+    int total_accounts;
+    Conn *conns;
+    int *free_slots; //Open loop: connections not running a session
+    int num_free;
+    int *thinking;   //Sessions in ST_THINK, in due order (FIFO: the think time is fixed)
+    int think_head, think_len;
+    LoadStats stats;
+} LoadThread;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int lat_bucket(long long ns) {
+    unsigned long long us = ns / 1000;
+    if (us < 64) return us;
+    int shift = 63 - __builtin_clzll(us) - 5;
+    int b = (shift + 1) * 32 + ((us >> shift) & 31);
+    return b < LAT_BUCKETS ? b : LAT_BUCKETS - 1;
+}
+
+//Lower bound of a bucket in microseconds
+static long long bucket_us(int b) {
+    if (b < 64) return b;
+    return (long long)(32 + b % 32) << (b / 32 - 1);
+}
+
+static size_t frame_size(int state) {
+    switch (state) {
+        case ST_SEND_LOGIN: return 8 + sizeof(LoginRequest);
+        case ST_RECV_LOGIN: return 8 + sizeof(LoginResponse);
+        case ST_SEND_TX:    return 8 + sizeof(Request);
+        default:            return 8 + sizeof(Response);
+    }
+}
+
+//Registers (or switches) the events a session waits for; skips the syscall if unchanged
+static void watch(LoadThread *t, Conn *c, int out) {
+    if (c->watching == out + 1) return;
+    struct epoll_event ev = { .events = out ? EPOLLOUT : EPOLLIN, .data.u32 = c - t->conns };
+    epoll_ctl(t->epfd, c->watching ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->fd, &ev);
+    c->watching = out + 1;
+}
+
+//Opens a non-blocking connection to the account's home shard. Returns 0, or -1 on failure.
+static int conn_open(LoadThread *t, Conn *c) {
+    int shard = shard_for_account(t->cfg->map, c->account_id);
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) { c->fd = -1; c->state = ST_DONE; t->stats.io_errors++; return -1; }
+
+    //Past one address' worth of source ports, spread loopback sessions over 127.0.0.x
+    int idx = t->first_conn + (c - t->conns);
+    if (t->cfg->connections > PORTS_PER_ADDR &&
+        (ntohl(t->dest[shard].sin_addr.s_addr) >> 24) == 127) {
+        struct sockaddr_in src = { .sin_family = AF_INET,
+                                   .sin_addr.s_addr = htonl(0x7f000001 + idx / PORTS_PER_ADDR) };
+#ifdef IP_BIND_ADDRESS_NO_PORT
+        int one = 1;
+        setsockopt(c->fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+#endif
+        bind(c->fd, (struct sockaddr *)&src, sizeof(src));
+    }
+
+    if (connect(c->fd, (struct sockaddr *)&t->dest[shard], sizeof(t->dest[shard])) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        c->state = ST_DONE;
+        t->stats.io_errors++;
+        return -1;
+    }
+    c->state = ST_CONNECTING;
+    t->active++;
+    t->connecting++;
+    c->watching = 0;
+    watch(t, c, 1);
+    return 0;
+}
+
+static void conn_close(LoadThread *t, Conn *c) {
+    if (c->fd >= 0) {
+        close(c->fd); //Closing also removes it from the epoll set
+        t->active--;
+        if (c->state == ST_CONNECTING) t->connecting--;
+    }
+    c->fd = -1;
+    c->state = ST_DONE;
+}
+
+//Ends a session; in open loop its connection becomes free for the next arrival
+static void session_done(LoadThread *t, Conn *c) {
+    conn_close(t, c);
+    if (t->free_slots) t->free_slots[t->num_free++] = c - t->conns;
+}
+
+//Fills buf with the next random transaction, as the threaded client chooses them
+static void build_tx(LoadThread *t, Conn *c) {
+    Request req = {0};
+    //A one-account map has no one to transfer to
+    int op_type = t->total_accounts > 1 ? rand_r(&t->seed) % 3 : 1 + rand_r(&t->seed) % 2;
+    if (t->cfg->read_only) {
+        req.op = OP_BALANCE;
+    } else if (op_type == 0) {
+        req.op = OP_TRANSFER;
+        do {
+            req.dst_id = shard_nth_account(t->cfg->map, rand_r(&t->seed) % t->total_accounts);
+        } while (req.dst_id == c->account_id);
+        req.amount = (rand_r(&t->seed) % 100) + 1;
+    } else {
+        req.op = op_type == 1 ? OP_DEPOSIT : OP_WITHDRAW;
+        req.amount = (rand_r(&t->seed) % 100) + 1;
+    }
+    c->op = req.op;
+    c->amount = req.amount;
+    xor_cipher(&req, sizeof(Request));
+    frame_encode(c->buf, &req, sizeof(Request));
+    c->state = ST_SEND_TX;
+    c->off = 0;
+}
+
+/*
+Advances one session's state machine as far as the socket allows:
+connect -> send login -> receive login -> (send tx -> receive tx) x remaining -> close.
+A failed session counts as an I/O error for the transaction in flight.
+ */
+static void conn_step(LoadThread *t, Conn *c) {
+    while (c->state != ST_DONE) {
+        if (c->state == ST_CONNECTING) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err) goto fail;
+            t->connecting--;
+            LoginRequest login = {0};
+            unsigned char enc[sizeof(LoginRequest)];
+            snprintf(login.username, LOGIN_USERNAME_LEN, "user%d", c->account_id);
+            snprintf(login.password, LOGIN_PASSWORD_LEN, "pass%d", c->account_id);
+            aes_encrypt(&login, enc, sizeof(LoginRequest));
+            frame_encode(c->buf, enc, sizeof(LoginRequest));
+            c->state = ST_SEND_LOGIN;
+            c->off = 0;
+            continue;
+        }
+
+        size_t size = frame_size(c->state);
+        int sending = c->state == ST_SEND_LOGIN || c->state == ST_SEND_TX;
+        if (c->state == ST_SEND_TX && c->off == 0) {
+            //Open loop: the first request is timed from the session's arrival, queueing included
+            if (c->from_arrival) c->from_arrival = 0;
+            else c->t_send = now_ns();
+        }
+        ssize_t n = sending ? write(c->fd, c->buf + c->off, size - c->off)
+                            : read(c->fd, c->buf + c->off, size - c->off);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            watch(t, c, sending);
+            return;
+        }
+        if (n <= 0) goto fail;
+        c->off += n;
+        if (c->off < size) continue;
+
+        c->off = 0;
+        switch (c->state) {
+            case ST_SEND_LOGIN: c->state = ST_RECV_LOGIN; break;
+            case ST_SEND_TX:    c->state = ST_RECV_TX; break;
+            case ST_RECV_LOGIN: {
+                LoginResponse res = {0};
+                if (frame_verify(c->buf, sizeof(LoginResponse)) != 0) goto fail;
+                aes_decrypt(c->buf + 8, &res, sizeof(LoginResponse));
+                if (res.success != 1) {
+                    if (res.retry_after_ms > 0) t->stats.busy++;
+                    else t->stats.login_failed++;
+                    session_done(t, c);
+                    return;
+                }
+                t->stats.sessions++;
+                build_tx(t, c);
+                break;
+            }
+            case ST_RECV_TX: {
+                long long latency = now_ns() - c->t_send;
+                Response res;
+                if (frame_verify(c->buf, sizeof(Response)) != 0) goto fail;
+                memcpy(&res, c->buf + 8, sizeof(Response));
+                xor_cipher(&res, sizeof(Response));
+                if (res.status == RES_BUSY) {
+                    t->stats.busy++;
+                } else {
+                    t->stats.tx_count++;
+                    t->stats.total_latency_ns += latency;
+                    t->stats.hist[lat_bucket(latency)]++;
+                }
+                if (res.status == RES_OK) {
+                    t->stats.tx_ok++;
+                    if (c->op == OP_DEPOSIT) t->stats.net_flow += c->amount;
+                    if (c->op == OP_WITHDRAW) t->stats.net_flow -= c->amount;
+                }
+                if (--c->remaining <= 0) { session_done(t, c); return; }
+                if (t->cfg->think_ms > 0) {
+                    //Park the session off the epoll set until its next request is due
+                    epoll_ctl(t->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+                    c->watching = 0;
+                    c->state = ST_THINK;
+                    c->t_send = now_ns() + t->cfg->think_ms * 1000000LL;
+                    t->thinking[(t->think_head + t->think_len++) % t->count] = c - t->conns;
+                    return;
+                }
+                build_tx(t, c);
+                break;
+            }
+        }
+    }
+    return;
+
+fail:
+    t->stats.io_errors++;
+    conn_close(t, c);
+    //Like the threaded client, a failed attempt uses up one transaction before retrying
+    if (--c->remaining > 0 && conn_open(t, c) == 0) return;
+    session_done(t, c);
+}
+
+//Sends the next request of every session whose think time is over.
+//Returns the ms until the next one is due (-1 if none is thinking).
+static int wake_thinkers(LoadThread *t, long long now) {
+    while (t->think_len > 0) {
+        Conn *c = &t->conns[t->thinking[t->think_head]];
+        if (c->t_send > now) return (c->t_send - now + 999999) / 1000000;
+        t->think_head = (t->think_head + 1) % t->count;
+        t->think_len--;
+        build_tx(t, c);
+        conn_step(t, c);
+    }
+    return -1;
+}
+
+//Open loop: starts every session whose arrival time has passed, on a free connection
+static void start_arrivals(LoadThread *t, long long start, long long now) {
+    double rate = t->cfg->rate * t->count / t->cfg->connections; //This thread's share
+    long long due = (now - start) / 1e9 * rate;
+    for (; t->stats.arrivals < due; t->stats.arrivals++) {
+        if (t->num_free == 0) { t->stats.overflow++; continue; }
+        Conn *c = &t->conns[t->free_slots[--t->num_free]];
+        c->account_id = shard_nth_account(t->cfg->map, (t->first_conn + t->stats.arrivals) % t->total_accounts);
+        c->remaining = t->cfg->tx_per_session;
+        c->t_send = start + (long long)(t->stats.arrivals * 1e9 / rate);
+        c->from_arrival = 1;
+        if (conn_open(t, c) != 0) session_done(t, c);
+    }
+}
+
+static void *loadgen_thread(void *arg) {
+    LoadThread *t = arg;
+    struct epoll_event events[256];
+    int open_loop = t->cfg->rate > 0;
+    long long start = now_ns(), end = start + (long long)(t->cfg->duration_sec * 1e9);
+
+    for (int i = 0; i < t->count; i++) {
+        Conn *c = &t->conns[i];
+        c->fd = -1;
+        c->state = ST_DONE;
+        if (open_loop) {
+            t->free_slots[t->num_free++] = t->count - 1 - i;
+            continue;
+        }
+        c->account_id = shard_nth_account(t->cfg->map, (t->first_conn + i) % t->total_accounts);
+        c->remaining = t->cfg->tx_per_session;
+        conn_open(t, c);
+    }
+
+    long long last_activity = now_ns();
+    while (!*t->cfg->stop) {
+        long long now = now_ns();
+        int arriving = open_loop && now < end;
+        if (arriving) start_arrivals(t, start, now);
+        else if (t->active == 0) break;
+        int timeout = arriving ? 1 : 200;
+        int next_wake = wake_thinkers(t, now);
+        if (next_wake >= 0 && next_wake < timeout) timeout = next_wake;
+
+        int n = epoll_wait(t->epfd, events, 256, timeout);
+        if (n < 0 && errno != EINTR) break;
+        if (n <= 0) {
+            if (!arriving && t->connecting == 0 && t->think_len == 0 && now_ns() - last_activity > STALL_TIMEOUT_MS * 1000000LL) break;
+            continue;
+        }
+        last_activity = now_ns();
+        for (int i = 0; i < n; i++) conn_step(t, &t->conns[events[i].data.u32]);
+    }
+
+    //Stopped or stalled: whatever is still in flight counts as failed
+    for (int i = 0; i < t->count; i++) {
+        if (t->conns[i].state == ST_DONE) continue;
+        t->stats.io_errors++;
+        conn_close(t, &t->conns[i]);
+    }
+    return NULL;
+}
+
+/*
+Runs cfg->connections concurrent sessions on cfg->threads epoll loops and
+merges the per-thread statistics into *stats. Each session logs in once and
+then sends cfg->tx_per_session transactions; latency is measured from the
+first byte sent to the last byte of the response.
+With cfg->rate > 0 the load is open loop instead: sessions arrive at that rate
+for cfg->duration_sec whether or not earlier ones have finished (up to
+cfg->connections in flight), and each session's first request is timed from
+its arrival, so time spent queueing at the server shows up in the latency.
+The open-file limit is raised as far as allowed, and the number of
+connections reduced to fit it. Returns the number of connections used, or -1.
+ */
+int loadgen_run(const LoadConfig *cfg, LoadStats *stats) {
+    const ShardMap *map = cfg->map;
+    struct sockaddr_in dest[MAX_SHARDS];
+    for (int i = 0; i < map->n; i++) {
+        dest[i] = (struct sockaddr_in){ .sin_family = AF_INET, .sin_port = htons(map->shards[i].port) };
+        if (inet_pton(AF_INET, map->shards[i].host, &dest[i].sin_addr) != 1) return -1;
+    }
+
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    int connections = cfg->connections;
+    if ((rlim_t)connections + 64 > rl.rlim_cur) connections = rl.rlim_cur - 64;
+    int threads = cfg->threads < 1 ? 1 : cfg->threads;
+    if (threads > connections) threads = connections;
+    if (connections <= 0) return -1;
+
+    LoadThread *lt = calloc(threads, sizeof(LoadThread));
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    long long start = now_ns();
+    for (int i = 0; i < threads; i++) {
+        LoadThread *t = &lt[i];
+        t->cfg = cfg;
+        t->dest = dest;
+        t->first_conn = (long long)connections * i / threads;
+        t->count = (long long)connections * (i + 1) / threads - t->first_conn;
+        t->epfd = epoll_create1(0);
+        t->seed = time(NULL) ^ (i * 2654435761u);
+        t->total_accounts = shard_map_total(map);
+        t->conns = calloc(t->count, sizeof(Conn));
+        if (cfg->rate > 0) t->free_slots = malloc(t->count * sizeof(int));
+        if (cfg->think_ms > 0) t->thinking = malloc(t->count * sizeof(int));
+        pthread_create(&tids[i], NULL, loadgen_thread, t);
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        LoadStats *s = &lt[i].stats;
+        stats->sessions += s->sessions;
+        stats->login_failed += s->login_failed;
+        stats->io_errors += s->io_errors;
+        stats->busy += s->busy;
+        stats->arrivals += s->arrivals;
+        stats->overflow += s->overflow;
+        stats->tx_count += s->tx_count;
+        stats->tx_ok += s->tx_ok;
+        stats->net_flow += s->net_flow;
+        stats->total_latency_ns += s->total_latency_ns;
+        for (int b = 0; b < LAT_BUCKETS; b++) stats->hist[b] += s->hist[b];
+        close(lt[i].epfd);
+        free(lt[i].conns);
+        free(lt[i].free_slots);
+        free(lt[i].thinking);
+    }
+    stats->elapsed_sec = (now_ns() - start) / 1e9;
+    free(lt);
+    free(tids);
+    return connections;
+}
+
+//Latency at percentile p (0-100) of the received responses, in ms
+double loadgen_percentile_ms(const LoadStats *stats, double p) {
+    long long rank = stats->tx_count * p / 100, seen = 0;
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        seen += stats->hist[b];
+        if (seen > rank) return bucket_us(b) / 1000.0;
+    }
+    return 0;
+}
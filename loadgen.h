@@ -0,0 +1,39 @@
+#ifndef LOADGEN_H
+#define LOADGEN_H
+#include <signal.h>
+#include "models.h"
+
+//Latency histogram: 32 buckets per power of two of microseconds (about 3% resolution)
+#define LAT_BUCKETS 1280
+
+typedef struct {
+    const ShardMap *map;
+    int connections;    //Concurrent sessions (one simulated user each)
+    int threads;        //Event loops; each drives connections / threads sessions
+    int tx_per_session; //Transactions sent on each session before it closes
+    int read_only;      //Only send OP_BALANCE
+    int think_ms;       //Pause between a response and the session's next request
+    double rate;        //Open loop: new sessions per second, up to 'connections' at once (0 = closed loop)
+    double duration_sec; //Open loop: how long new sessions keep arriving
+    volatile sig_atomic_t *stop;
+} LoadConfig;
+
+typedef struct {
+    long long sessions;       //Successful logins
+    long long login_failed;
+    long long io_errors;      //Connect, send or receive failures (and timeouts)
+    long long busy;           //Sessions or requests shed by the server (RES_BUSY)
+    long long arrivals;       //Open loop: sessions due to start
+    long long overflow;       //Open loop: arrivals dropped because every connection was in use
+    long long tx_count;       //Responses received, excluding RES_BUSY rejections
+    long long tx_ok;          //Responses with RES_OK
+    long long net_flow;       //Net money added by successful deposits/withdrawals
+    long long total_latency_ns;
+    long long hist[LAT_BUCKETS];
+    double elapsed_sec;
+} LoadStats;
+
+int loadgen_run(const LoadConfig *cfg, LoadStats *stats);
+double loadgen_percentile_ms(const LoadStats *stats, double p);
+
+#endif
@@ -6,27 +6,150 @@
 
 #define LOGIN_USERNAME_LEN 16
 #define LOGIN_PASSWORD_LEN 16
-#define MAX_ACCOUNTS 100
+#define MAX_ACCOUNTS 100 //Default ledger size when no account file is loaded
+#define MAX_LEDGER_ACCOUNTS (64 * 1024 * 1024) //Upper bound for a bulk-loaded shard
+#define INITIAL_BALANCE 1000
 #define PORT 8888
 #define SHM_NAME "/mutex_bank_shm"
 
-typedef enum { OP_TRANSFER = 1, OP_DEPOSIT = 2, OP_WITHDRAW = 3 } OpCode;
-typedef enum { RES_OK = 0, RES_ERROR, RES_NO_FUNDS } ResCode;
+//Sharding: each server instance owns a contiguous range of account IDs
+#define MAX_SHARDS 16
+#define SHARD_HOST_LEN 64
+#define PEER_PORT_OFFSET 1000 //Shard-to-shard (2PC) traffic uses port + PEER_PORT_OFFSET
+#define PEER_USERNAME "shard-peer"    //2PC sessions; the password is read from PEER_SECRET_ENV at startup
+#define PEER_SECRET_ENV "BANK_PEER_SECRET" //Set on every server only: clients never hold it
+#define ADMIN_USERNAME "bank-admin"   //Audit, status, batch jobs and replication streams (no 2PC)
+#define ADMIN_PASSWORD "admin-secret"
+#define DEFAULT_SHARD_MAP "127.0.0.1:8888:0:100"
 
-typedef struct { int src_id; int dst_id; int amount; OpCode op; } Request;
-typedef struct { ResCode status; int balance; char msg[64]; } Response;
+//Replication: followers pull the ordered change log from port + REPL_PORT_OFFSET
+#define REPL_PORT_OFFSET 2000
+#define REPL_LOG_SIZE 65536 //Records kept in the shared-memory ring (power of two)
+#define REPL_BATCH 256      //Records per network frame
+#define REPL_MAX_FOLLOWERS 16 //Followers whose progress is tracked (for backpressure)
 
-typedef struct { int id; long long balance; pthread_mutex_t lock; } Account;
+typedef enum {
+    OP_TRANSFER = 1, OP_DEPOSIT = 2, OP_WITHDRAW = 3,
+    //Peer-only operations (two-phase commit and auditing)
+    OP_PREPARE = 4, OP_COMMIT = 5, OP_ABORT = 6, OP_AUDIT = 7,
+    //Read-only operations (served by followers as well)
+    OP_BALANCE = 8, OP_STATUS = 9,
+    //Batch posting over a range of accounts (peer port; src_id..dst_id, rule value in amount)
+    OP_BATCH_RATE = 10,  //Interest: balance * amount / 10000 (basis points)
+    OP_BATCH_FEE = 11,   //Flat fee of amount, skipped if the balance cannot cover it
+    OP_BATCH_BONUS = 12  //Bonus of amount for balances >= param
+} OpCode;
+//RES_BUSY: shed by admission control; Response.balance holds the suggested retry delay in ms
+typedef enum { RES_OK = 0, RES_ERROR, RES_NO_FUNDS, RES_BUSY } ResCode;
+
+typedef struct {
+    int src_id; int dst_id; int amount; OpCode op;
+    long long txid;  //Cross-shard transaction ID (2PC)
+    long long param; //Extra operand (OP_BATCH_BONUS: minimum balance)
+} Request;
+typedef struct { ResCode status; long long balance; char msg[64]; } Response;
+
+typedef struct {
+    int id; long long balance; pthread_mutex_t lock;
+    long long rate_tat_ns; //Per-account rate limit: earliest time the next request conforms (GCRA)
+} Account;
 
 typedef struct { char username[LOGIN_USERNAME_LEN]; char password[LOGIN_PASSWORD_LEN]; } LoginRequest;
-typedef struct { int success; char msg[64]; } LoginResponse;
+//retry_after_ms > 0: the session was shed by admission control (RES_BUSY) before login
+typedef struct { int success; int retry_after_ms; char msg[64]; } LoginResponse;
+
+//One applied balance change: 'amount' moves from src_id to dst_id (-1 = outside the bank)
+typedef struct { long long seq; int src_id; int dst_id; long long amount; } ReplRecord;
 
+typedef enum { REPL_SNAPSHOT = 1, REPL_RECORDS = 2 } ReplFrameType;
+//Network frame of the replication stream. In a snapshot, records carry absolute balances.
 typedef struct {
-    Account accounts[MAX_ACCOUNTS];
+    ReplFrameType type;
+    int count;
+    long long primary_seq; //Primary's next sequence number when the frame was sent
+    int first_id;          //Primary's account range: a follower refuses a ledger unlike its own
+    int num_accounts;
+    ReplRecord records[REPL_BATCH];
+} ReplFrame;
+
+//2PC participant: a credit this shard voted yes on. Entries live in shared memory so
+//any peer worker can finish the transaction after the coordinator's session is lost.
+//Finished entries are kept (oldest reused first) so a retried COMMIT or ABORT is idempotent.
+#define MAX_PREPARED_TX 1024
+typedef enum { TX_FREE = 0, TX_PREPARED, TX_COMMITTED, TX_ABORTED } TxState;
+typedef struct { long long txid; int src_id; int dst_id; int amount; TxState state; long long stamp; } PreparedTx;
+
+//Shared-memory ledger. Its size depends on the number of accounts: see bank_size().
+typedef struct {
+    int first_id;      //Global ID of accounts[0]
+    int num_accounts;  //Number of accounts owned by this shard
     pthread_mutex_t global_lock;
     pthread_mutex_t log_lock;
     long long total_tx_count;
     long long total_latency_ns;
+    long long next_txid; //Sequence for cross-shard transaction IDs
+
+    //2PC participant state
+    pthread_mutex_t tx_lock;       //Protects prepared_tx and tx_clock
+    long long tx_clock;            //Stamps finished entries in the order they finished
+    PreparedTx prepared_tx[MAX_PREPARED_TX];
+
+    //Replication state
+    pthread_mutex_t repl_lock;
+    pthread_cond_t repl_cond;      //Signalled whenever a record is appended
+    long long repl_head;           //Sequence number of the next record
+    long long repl_primary_seq;    //Follower: newest sequence reported by the primary
+    long long repl_last_contact_ns; //Follower: CLOCK_MONOTONIC time of the last frame
+    int repl_followers;            //Connected followers (changed only under every account lock)
+    int repl_waiters;              //Senders blocked on repl_cond
+    long long repl_sent[REPL_MAX_FOLLOWERS]; //Next record each follower's sender will copy (-1 = free)
+    int read_only;                 //Follower: reject writes until promoted
+    ReplRecord repl_log[REPL_LOG_SIZE];
+
+    //Admission control (see admit.c)
+    long long admit_wait_us;       //Moving average of the time sessions spent in the accept queue
+    long long admit_shed_sessions; //Sessions rejected as busy before login
+    long long admit_shed_requests; //Requests rejected by the per-account rate limit
+
+    Account accounts[]; //num_accounts entries
 } Bank;
 
-#endif
\ No newline at end of file
+//Binary account file: header followed by 'count' long long balances (IDs first_id, first_id+1, ...)
+#define ACCOUNT_FILE_MAGIC "MBACCT01"
+typedef struct { char magic[8]; int first_id; int count; } AccountFileHeader;
+
+//A batch posting job and the summary of one of its partitions
+#define MAX_BATCH_PARTITIONS 64
+typedef struct { OpCode op; int first_id; int last_id; long long value; long long threshold; } BatchRule;
+typedef struct {
+    int first_id; int last_id; long long processed; long long posted; long long net; long long elapsed_ns;
+    long long throttled_ms; //Time spent waiting for followers to catch up
+    long long overflowed;   //Accounts skipped because the posting would overflow a balance
+} BatchPartition;
+
+//Workload trace: header, the starting balance of every account (num_accounts long
+//longs), one TraceRecord per client request, then (on clean shutdown) the final balances
+#define TRACE_MAGIC "MBTRACE2"
+typedef struct {
+    char magic[8];
+    int first_id;
+    int num_accounts;
+    long long final_offset; //File offset of the final balances, 0 if capture did not finish
+} TraceHeader;
+typedef struct {
+    long long ts_ns;       //CLOCK_MONOTONIC time the request was received
+    long long seq;         //Apply order: replication sequence number of the change, or the
+                           //next one if the request changed nothing (see handle_transfer)
+    int account_id;        //Logged-in account (the request's source)
+    int dst_id;
+    int amount;
+    unsigned char op;      //OpCode
+    unsigned char status;  //ResCode the server answered with
+    short reserved;
+} TraceRecord;
+
+//One entry of the shard map: where a range of account IDs lives
+typedef struct { char host[SHARD_HOST_LEN]; int port; int first_id; int count; } ShardInfo;
+typedef struct { int n; ShardInfo shards[MAX_SHARDS]; } ShardMap;
+
+#endif
@@ -0,0 +1,32 @@
+#include "perfcount.h"
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/*
+Opens a hardware counter of data-TLB load misses for the calling process.
+With 'inherit', children forked afterwards are counted too (their counts are
+folded in when they exit). Returns -1 if perf events are unavailable
+(e.g. no PMU in a VM, or kernel.perf_event_paranoid forbids it).
+ */
+int perf_tlb_open(int inherit) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.inherit = inherit;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+//Current value of a counter, or -1 if it cannot be read
+long long perf_read(int fd) {
+    long long value;
+    if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) return -1;
+    return value;
+}
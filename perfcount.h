@@ -0,0 +1,7 @@
+#ifndef PERFCOUNT_H
+#define PERFCOUNT_H
+
+int perf_tlb_open(int inherit);
+long long perf_read(int fd);
+
+#endif
@@ -1,5 +1,7 @@
 #include "protocol.h"
 #include <unistd.h>
+#include <string.h>
+#include <sys/uio.h>
 
 /*Calculates the CRC32 checksum of a data buffer.
 used to detect accidental changes to raw data (integrity check)*/
@@ -27,32 +29,66 @@ uint32_t crc32(const void *buf, size_t len) {
 
 /*Sends a data packet with a custom protocol header.
 Frame Format: [Length (4 bytes)] + [Checksum (4 bytes)] + [Payload (N bytes)]
-This solves TCP "sticky packet" issues.*/
+This solves TCP "sticky packet" issues.
+The whole frame goes out in one writev(): three small write() calls would let
+Nagle's algorithm hold the payload back until the peer's delayed ACK (~40 ms).*/
 int send_packet(int sock, void *data, size_t len) {
     uint32_t length = len;
     //Calculate checksum for data integrity
     uint32_t checksum = crc32(data, len);
-    //1. Send the length of the payload first
-    if (write(sock, &length, 4) != 4) return -1;
-    //2. Send the checksum
-    if (write(sock, &checksum, 4) != 4) return -1;
-    //3. Send the actual data payload
-    if (write(sock, data, len) != (ssize_t)len) return -1;
+    struct iovec iov[3] = {
+        { &length, 4 },   //1. Length of the payload
+        { &checksum, 4 }, //2. Checksum
+        { data, len }     //3. The actual data payload
+    };
+    if (writev(sock, iov, 3) != (ssize_t)(8 + len)) return -1;
     return 0;
 }
 
+/*Builds the same frame as send_packet into 'frame' (which needs 8 + len bytes)
+for callers that do their own non-blocking writes. Returns the frame size.*/
+size_t frame_encode(void *frame, const void *data, size_t len) {
+    uint32_t length = len, checksum = crc32(data, len);
+    memcpy(frame, &length, 4);
+    memcpy((char *)frame + 4, &checksum, 4);
+    memcpy((char *)frame + 8, data, len);
+    return 8 + len;
+}
+
+/*Checks a complete frame received into 'frame' (8 + len bytes): the length
+header must equal 'len' and the checksum must match. Returns 0 if valid.*/
+int frame_verify(const void *frame, size_t len) {
+    uint32_t length, checksum;
+    memcpy(&length, frame, 4);
+    memcpy(&checksum, (const char *)frame + 4, 4);
+    if (length != len) return -1;
+    return crc32((const char *)frame + 8, len) == checksum ? 0 : -2;
+}
+
+/*Reads exactly 'len' bytes, looping over short reads
+(large frames can arrive in several TCP segments).*/
+static ssize_t read_full(int sock, void *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(sock, (char *)buf + got, len - got);
+        if (n <= 0) return -1;
+        got += n;
+    }
+    return got;
+}
+
 /*Receives a packet following the custom frame format.
 Returns the number of bytes read, or negative values on error.*/
 int recv_packet(int sock, void *buf, size_t buf_size) {
     uint32_t length, checksum;
     //1. Read the length header (4 bytes) to know how much data to expect
-    if (read(sock, &length, 4) != 4) return -1;
+    if (read_full(sock, &length, 4) != 4) return -1;
     //Security check: Prevent buffer overflow if the incoming packet is too large
     if (length > buf_size) return -1;
     //2. Read the checksum header (4 bytes)
-    if (read(sock, &checksum, 4) != 4) return -1;
+    if (read_full(sock, &checksum, 4) != 4) return -1;
     //3. Read the exact amount of data specified by 'length'
-    if (read(sock, buf, length) != (ssize_t)length) return -1;
+    if (read_full(sock, buf, length) != (ssize_t)length) return -1;
     /*4. integrity check: Re-calculate CRC32 and compare with the received checksum
     Returns -2 if data corruption is detected*/
     if (crc32(buf, length) != checksum) return -2;
@@ -6,5 +6,7 @@
 uint32_t crc32(const void *buf, size_t len);
 int send_packet(int sock, void *data, size_t len);
 int recv_packet(int sock, void *buf, size_t buf_size);
+size_t frame_encode(void *frame, const void *data, size_t len);
+int frame_verify(const void *frame, size_t len);
 
 #endif
\ No newline at end of file
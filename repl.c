@@ -0,0 +1,230 @@
+#include "repl.h"
+#include "bank_core.h"
+#include "protocol.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <time.h>
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+Appends one applied balance change to the replication ring in shared memory.
+MUST be called while holding the lock(s) of the affected account(s): a snapshot
+taken under every account lock then never sees a change without its record.
+With no follower connected nothing reads the ring, so only the sequence number
+advances and writers do not serialize on repl_lock. Followers register and
+unregister while holding every account lock, so the two paths never overlap
+and no writer can skip a record a follower needs.
+Returns the record's sequence number: the order in which changes were applied.
+ */
+long long repl_append(Bank *bank, int src_id, int dst_id, long long amount) {
+    if (bank->repl_followers == 0) return __sync_fetch_and_add(&bank->repl_head, 1);
+    pthread_mutex_lock(&bank->repl_lock);
+    long long seq = bank->repl_head++;
+    ReplRecord *r = &bank->repl_log[seq & (REPL_LOG_SIZE - 1)];
+    r->seq = seq;
+    r->src_id = src_id;
+    r->dst_id = dst_id;
+    r->amount = amount;
+    //Wake up the sender processes streaming to followers (only if one is asleep)
+    if (bank->repl_waiters > 0) pthread_cond_broadcast(&bank->repl_cond);
+    pthread_mutex_unlock(&bank->repl_lock);
+    return seq;
+}
+
+//Sends a frame using only as many bytes as it has records
+static int send_frame(Bank *bank, int sock, ReplFrame *frame) {
+    frame->first_id = bank->first_id;
+    frame->num_accounts = bank->num_accounts;
+    return send_packet(sock, frame, offsetof(ReplFrame, records) + frame->count * sizeof(ReplRecord));
+}
+
+//Every account lock in ID order, like transfers: stops all writers
+static void lock_all_accounts(Bank *bank) {
+    for (int i = 0; i < bank->num_accounts; i++) pthread_mutex_lock(&bank->accounts[i].lock);
+}
+
+static void unlock_all_accounts(Bank *bank) {
+    for (int i = bank->num_accounts - 1; i >= 0; i--) pthread_mutex_unlock(&bank->accounts[i].lock);
+}
+
+//Sends the snapshot taken at sequence 'next', then streams records from there on,
+//publishing its progress in '*sent' (NULL if this follower is not tracked)
+static int stream_to_follower(Bank *bank, int sock, const long long *balances, long long next, long long *sent) {
+    ReplFrame frame;
+    for (int i = 0; i < bank->num_accounts; i += REPL_BATCH) {
+        frame.type = REPL_SNAPSHOT;
+        frame.primary_seq = next;
+        frame.count = 0;
+        for (int j = i; j < bank->num_accounts && frame.count < REPL_BATCH; j++)
+            frame.records[frame.count++] = (ReplRecord){ next, -1, bank->accounts[j].id, balances[j] };
+        if (send_frame(bank, sock, &frame) != 0) return -1;
+    }
+
+    //Stream: ship new records as soon as they are appended
+    while (1) {
+        frame.type = REPL_RECORDS;
+        frame.count = 0;
+
+        pthread_mutex_lock(&bank->repl_lock);
+        if (bank->repl_head == next) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 100000000L;
+            if (deadline.tv_nsec >= 1000000000L) { deadline.tv_sec++; deadline.tv_nsec -= 1000000000L; }
+            bank->repl_waiters++;
+            pthread_cond_timedwait(&bank->repl_cond, &bank->repl_lock, &deadline);
+            bank->repl_waiters--;
+        }
+        if (bank->repl_head - next > REPL_LOG_SIZE) {
+            pthread_mutex_unlock(&bank->repl_lock);
+            return -1;
+        }
+        while (next < bank->repl_head && frame.count < REPL_BATCH)
+            frame.records[frame.count++] = bank->repl_log[next++ & (REPL_LOG_SIZE - 1)];
+        frame.primary_seq = bank->repl_head;
+        if (sent) *sent = next;
+        pthread_mutex_unlock(&bank->repl_lock);
+
+        if (send_frame(bank, sock, &frame) != 0) return -1;
+    }
+}
+
+/*
+Primary side: sends a consistent snapshot of all balances, then streams every
+new record in order. Sends an empty frame every 100 ms as a heartbeat so the
+follower can measure its lag. Returns -1 when the follower disconnects or falls
+more than REPL_LOG_SIZE records behind (it will then resync from a new snapshot).
+ */
+int repl_send_stream(Bank *bank, int sock) {
+    long long *balances = malloc(bank->num_accounts * sizeof(long long));
+    if (!balances) return -1;
+
+    //Snapshot: hold every account lock so the balances and the sequence number
+    //describe exactly the same state. Registering as a follower here makes every
+    //later write fill the ring.
+    lock_all_accounts(bank);
+    bank->repl_followers++;
+    long long next = bank->repl_head;
+    long long *sent = NULL;
+    for (int i = 0; i < REPL_MAX_FOLLOWERS && !sent; i++) {
+        if (bank->repl_sent[i] < 0) sent = &bank->repl_sent[i];
+    }
+    if (sent) *sent = next;
+    for (int i = 0; i < bank->num_accounts; i++) balances[i] = bank->accounts[i].balance;
+    unlock_all_accounts(bank);
+
+    int ret = stream_to_follower(bank, sock, balances, next, sent);
+    free(balances);
+    lock_all_accounts(bank);
+    bank->repl_followers--;
+    if (sent) *sent = -1;
+    unlock_all_accounts(bank);
+    return ret;
+}
+
+/*
+Records appended but not yet picked up by the slowest follower's sender
+(0 without followers). Bulk writers such as batch jobs, which can append far
+faster than the network drains the ring, wait while this nears REPL_LOG_SIZE
+so followers never overflow into a full snapshot resync.
+ */
+long long repl_backlog(Bank *bank) {
+    long long head = bank->repl_head, backlog = 0;
+    for (int i = 0; i < REPL_MAX_FOLLOWERS; i++) {
+        long long sent = bank->repl_sent[i];
+        if (sent >= 0 && head - sent > backlog) backlog = head - sent;
+    }
+    return backlog;
+}
+
+//Applies one streamed record to the local ledger and re-appends it, so this
+//follower's own ring stays in step with the primary (and can feed followers later)
+static void apply_record(Bank *bank, const ReplRecord *r) {
+    Account *src = r->src_id >= 0 ? bank_account(bank, r->src_id) : NULL;
+    Account *dst = r->dst_id >= 0 ? bank_account(bank, r->dst_id) : NULL;
+
+    //Deadlock Prevention: same lock order as handle_transfer (smaller ID first)
+    Account *first = src, *second = dst;
+    if (first == NULL || (second != NULL && second->id < first->id)) { first = dst; second = src; }
+
+    if (first) pthread_mutex_lock(&first->lock);
+    if (second) pthread_mutex_lock(&second->lock);
+    if (src) src->balance -= r->amount;
+    if (dst) dst->balance += r->amount;
+    repl_append(bank, r->src_id, r->dst_id, r->amount);
+    if (second) pthread_mutex_unlock(&second->lock);
+    if (first) pthread_mutex_unlock(&first->lock);
+}
+
+/*
+Follower side: applies the primary's stream to the local Bank until the
+connection fails or '*stop' is set. Returns -1 on error or gap in the sequence,
+-2 if the primary's account range differs from this ledger's (the follower
+would otherwise serve a partial or padded copy).
+ */
+int repl_receive_stream(Bank *bank, int sock, volatile sig_atomic_t *stop) {
+    ReplFrame frame;
+    while (!*stop) {
+        if (recv_packet(sock, &frame, sizeof(frame)) <= 0) return -1;
+        if (frame.count < 0 || frame.count > REPL_BATCH) return -1;
+        if (frame.first_id != bank->first_id || frame.num_accounts != bank->num_accounts) return -2;
+
+        for (int i = 0; i < frame.count; i++) {
+            ReplRecord *r = &frame.records[i];
+            if (frame.type == REPL_SNAPSHOT) {
+                Account *a = bank_account(bank, r->dst_id);
+                if (a == NULL) return -1;
+                pthread_mutex_lock(&a->lock);
+                a->balance = r->amount;
+                pthread_mutex_unlock(&a->lock);
+            } else {
+                //Only this process appends on a follower, so repl_head is stable here
+                if (r->seq < bank->repl_head) continue; //Already applied
+                if (r->seq > bank->repl_head) return -1; //Gap: resync from a new snapshot
+                apply_record(bank, r);
+            }
+        }
+        if (frame.type == REPL_SNAPSHOT) {
+            pthread_mutex_lock(&bank->repl_lock);
+            bank->repl_head = frame.primary_seq;
+            pthread_mutex_unlock(&bank->repl_lock);
+        }
+        bank->repl_primary_seq = frame.primary_seq;
+        bank->repl_last_contact_ns = now_ns();
+    }
+    return 0;
+}
+
+//Replication lag of a follower, in records not yet applied
+long long repl_lag(Bank *bank) {
+    long long lag = bank->repl_primary_seq - bank->repl_head;
+    return lag > 0 ? lag : 0;
+}
+
+/*
+Reads only the initial snapshot of a replication stream into 'balances'
+(indexed from first_id). Used to verify a ledger without following it.
+Returns 0 once all 'n' balances have arrived, -1 on error or if the server
+does not own all of them.
+ */
+int repl_fetch_snapshot(int sock, int first_id, int n, long long *balances) {
+    ReplFrame frame;
+    int received = 0;
+    while (received < n) {
+        if (recv_packet(sock, &frame, sizeof(frame)) <= 0) return -1;
+        if (frame.type != REPL_SNAPSHOT || frame.count < 0 || frame.count > REPL_BATCH) return -1;
+        if (first_id < frame.first_id || first_id + n > frame.first_id + frame.num_accounts) return -1;
+        for (int i = 0; i < frame.count; i++) {
+            int idx = frame.records[i].dst_id - first_id;
+            if (idx < 0 || idx >= n) continue;
+            balances[idx] = frame.records[i].amount;
+            received++;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,13 @@
+#ifndef REPL_H
+#define REPL_H
+#include <signal.h>
+#include "models.h"
+
+long long repl_append(Bank *bank, int src_id, int dst_id, long long amount);
+int repl_send_stream(Bank *bank, int sock);
+int repl_receive_stream(Bank *bank, int sock, volatile sig_atomic_t *stop);
+long long repl_lag(Bank *bank);
+long long repl_backlog(Bank *bank);
+int repl_fetch_snapshot(int sock, int first_id, int n, long long *balances);
+
+#endif
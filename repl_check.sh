@@ -0,0 +1,69 @@
+#!/bin/sh
+# Replication check on localhost: starts a primary and a follower (-f), drives
+# load on the primary with both clients and a batch job, waits until the follower
+# reports lag 0 and fails unless both report the same sequence number and assets.
+# Usage: ./repl_check.sh [primary port]
+
+PORT=${1:-9400}
+FPORT=$((PORT + 1))
+PRIMARY="127.0.0.1:$PORT:0:100"
+FOLLOWER="127.0.0.1:$FPORT:0:100"
+
+PIDS=""
+stop_servers() {
+    [ -n "$PIDS" ] && kill -INT $PIDS 2>/dev/null
+    for pid in $PIDS; do wait $pid 2>/dev/null; done
+    PIDS=""
+}
+trap stop_servers EXIT INT TERM
+
+echo "Primary: $PRIMARY, follower: $FOLLOWER"
+./server -p $PORT > repl_check_primary.out 2>&1 &
+PIDS="$PIDS $!"
+sleep 1
+./server -p $FPORT -f 127.0.0.1:$PORT > repl_check_follower.out 2>&1 &
+PIDS="$PIDS $!"
+sleep 1
+
+FAILED=0
+run_client() {
+    echo "--- ./client $*"
+    ./client -m "$PRIMARY" "$@" > repl_check_client.out 2>&1
+    status=$?
+    grep -a "總交易筆數\|資產核對\|批次總淨額" repl_check_client.out
+    [ $status -eq 0 ] || FAILED=1
+}
+run_client -t 10
+run_client -E 1 -c 200 -t 20
+run_client -b rate:50
+
+# The follower is caught up once it reports lag 0 at the primary's sequence number
+# ("... seq=N lag=L contact=Cms total=T")
+field() { sed -n "s/.* $1=\([-0-9]*\).*/\1/p"; }
+CAUGHT_UP=0
+n=0
+while [ $n -lt 30 ]; do
+    P=$(./client -m "$PRIMARY" -s)
+    F=$(./client -m "$FOLLOWER" -s)
+    if [ "$(echo "$F" | field lag)" = "0" ] && [ -n "$(echo "$P" | field seq)" ] &&
+       [ "$(echo "$P" | field seq)" = "$(echo "$F" | field seq)" ]; then
+        CAUGHT_UP=1
+        break
+    fi
+    sleep 1
+    n=$((n + 1))
+done
+echo "$P"
+echo "$F"
+
+if [ $CAUGHT_UP -eq 0 ]; then
+    echo "Follower did not catch up with the primary"
+    FAILED=1
+elif [ "$(echo "$P" | field total)" != "$(echo "$F" | field total)" ]; then
+    echo "Follower's total assets differ from the primary's"
+    FAILED=1
+fi
+
+stop_servers
+if [ $FAILED -eq 0 ]; then echo "repl_check: PASS"; else echo "repl_check: FAIL"; fi
+exit $FAILED
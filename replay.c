@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "models.h"
+#include "protocol.h"
+#include "shard.h"
+#include "repl.h"
+#include "trace.h"
+
+//Default number of concurrent replay connections (override with -c)
+#define REPLAY_CONNECTIONS 10
+
+ShardMap shard_map;
+TraceHeader trace_hdr;
+TraceRecord *records;
+long long *initial_balances;
+long long *final_balances;
+long num_records;
+long long first_ts, last_ts; //Capture time span
+
+//Replay options
+int num_conns = REPLAY_CONNECTIONS;
+int max_speed = 0;
+
+//Records grouped by connection: conn i replays by_conn[conn_start[i] .. conn_start[i+1])
+long *by_conn;
+long *conn_start;
+
+//Dependencies: record i may only run once deps[2*i] and deps[2*i+1] (-1 = none) are done,
+//the records just before it in apply order on its source and destination accounts
+long *deps;
+volatile char *done;
+pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+//Results
+long long *latencies; //Per record, -1 if the request failed
+long long failures = 0;
+long long status_mismatches = 0;
+long long skipped = 0; //Requests shed at capture time (RES_BUSY): they never reached the ledger
+long long start_ns;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+//A request that changed the ledger (its seq is its own change's sequence number)
+static int applied(const TraceRecord *r) {
+    return r->status == RES_OK && (r->op == OP_TRANSFER || r->op == OP_DEPOSIT || r->op == OP_WITHDRAW);
+}
+
+//Position in the server's apply order. A request that changed nothing saw the ledger
+//just before change 'seq', so it sorts before that change: 2*seq, changes at 2*seq+1.
+static long long apply_order(const TraceRecord *r) {
+    return 2 * r->seq + applied(r);
+}
+
+//Orders records as the server applied them (capture time breaks ties between reads)
+int compare_records(const void *a, const void *b) {
+    const TraceRecord *x = a, *y = b;
+    long long ox = apply_order(x), oy = apply_order(y);
+    if (ox != oy) return ox < oy ? -1 : 1;
+    if (x->ts_ns != y->ts_ns) return x->ts_ns < y->ts_ns ? -1 : 1;
+    return x->account_id - y->account_id;
+}
+
+/*
+Links every record to the previous one on each account it touches, so the replay
+gives each account exactly the recorded sequence of requests even though accounts
+joined by transfers are replayed on different connections. Balance queries and
+shed requests neither depend on nor hold back anything.
+ */
+void build_dependencies() {
+    long *last = malloc(trace_hdr.num_accounts * sizeof(long));
+    for (int i = 0; i < trace_hdr.num_accounts; i++) last[i] = -1;
+    deps = malloc(2 * num_records * sizeof(long));
+    done = calloc(num_records, 1);
+    for (long i = 0; i < num_records; i++) {
+        TraceRecord *r = &records[i];
+        int accs[2] = { r->account_id - trace_hdr.first_id, r->op == OP_TRANSFER ? r->dst_id - trace_hdr.first_id : -1 };
+        for (int k = 0; k < 2; k++) {
+            deps[2 * i + k] = -1;
+            int a = accs[k];
+            if (a < 0 || a >= trace_hdr.num_accounts || r->op == OP_BALANCE || r->status == RES_BUSY) continue;
+            if (k == 1 && a == accs[0]) continue;
+            deps[2 * i + k] = last[a];
+            last[a] = i;
+        }
+    }
+    free(last);
+}
+
+static void wait_done(long i) {
+    if (i < 0 || done[i]) return;
+    pthread_mutex_lock(&done_lock);
+    while (!done[i]) pthread_cond_wait(&done_cond, &done_lock);
+    pthread_mutex_unlock(&done_lock);
+}
+
+static void mark_done(long i) {
+    pthread_mutex_lock(&done_lock);
+    done[i] = 1;
+    pthread_cond_broadcast(&done_cond);
+    pthread_mutex_unlock(&done_lock);
+}
+
+int compare_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+//Sends one recorded request and checks its response status against the recording
+void replay_record(long i, TraceRecord *r) {
+    latencies[i] = -1;
+    if (r->status == RES_BUSY) { __sync_fetch_and_add(&skipped, 1); return; }
+    int shard = shard_for_account(&shard_map, r->account_id);
+    if (shard < 0) { __sync_fetch_and_add(&failures, 1); return; }
+
+    char username[LOGIN_USERNAME_LEN], password[LOGIN_PASSWORD_LEN];
+    snprintf(username, sizeof(username), "user%d", r->account_id);
+    snprintf(password, sizeof(password), "pass%d", r->account_id);
+
+    long long t0 = now_ns();
+    int sock = shard_open_session(shard_map.shards[shard].host, shard_map.shards[shard].port,
+                                  username, password);
+    Request req = { .dst_id = r->dst_id, .amount = r->amount, .op = r->op };
+    Response res = {0};
+    if (sock < 0 || shard_call(sock, &req, &res) != 0) {
+        if (sock >= 0) close(sock);
+        __sync_fetch_and_add(&failures, 1);
+        return;
+    }
+    latencies[i] = now_ns() - t0;
+    close(sock);
+
+    if (res.status != r->status) __sync_fetch_and_add(&status_mismatches, 1);
+}
+
+/*
+Replays one connection's share of the trace. Records are assigned to
+connections by source account and taken in apply order; a record also waits
+for its dependencies on other connections (see build_dependencies), so the
+outcome does not depend on timing. Like the stress client, each request uses
+its own login session.
+ */
+void *replay_task(void *arg) {
+    int conn = *(int*)arg;
+    free(arg);
+
+    for (long k = conn_start[conn]; k < conn_start[conn + 1]; k++) {
+        long i = by_conn[k];
+        TraceRecord *r = &records[i];
+
+        //Original pacing: wait until this record's offset from the start of the trace
+        if (!max_speed) {
+            long long wait = start_ns + (r->ts_ns - first_ts) - now_ns();
+            if (wait > 0) {
+                struct timespec ts = { wait / 1000000000LL, wait % 1000000000LL };
+                nanosleep(&ts, NULL);
+            }
+        }
+        wait_done(deps[2 * i]);
+        wait_done(deps[2 * i + 1]);
+        replay_record(i, r);
+        mark_done(i);
+    }
+    return NULL;
+}
+
+//Reads this shard's current balances through a replication snapshot. Returns them
+//(caller frees), or NULL if the server could not be read.
+long long *fetch_server_balances() {
+    int shard = shard_for_account(&shard_map, trace_hdr.first_id);
+    if (shard < 0) return NULL;
+    ShardInfo *s = &shard_map.shards[shard];
+    int sock = shard_open_session(s->host, s->port + REPL_PORT_OFFSET, ADMIN_USERNAME, ADMIN_PASSWORD);
+    if (sock < 0) return NULL;
+
+    long long *balances = calloc(trace_hdr.num_accounts, sizeof(long long));
+    int ret = repl_fetch_snapshot(sock, trace_hdr.first_id, trace_hdr.num_accounts, balances);
+    close(sock);
+    if (ret != 0) { free(balances); return NULL; }
+    return balances;
+}
+
+//Compares the server's balances with the recorded ones ('expected').
+//Returns the number of accounts that differ, or -1 if the server could not be read.
+int verify_balances(const long long *expected) {
+    long long *balances = fetch_server_balances();
+    if (!balances) return -1;
+    int diffs = 0;
+    for (int i = 0; i < trace_hdr.num_accounts; i++) {
+        if (balances[i] != expected[i]) {
+            if (diffs < 10)
+                printf("  Acc %02d: 伺服器 $%lld, 錄製 $%lld\n", trace_hdr.first_id + i, balances[i], expected[i]);
+            diffs++;
+        }
+    }
+    free(balances);
+    return diffs;
+}
+
+int main(int argc, char *argv[]) {
+    //Options: -m <shard map>, -c <connections>, -x (as fast as possible instead of original pacing)
+    const char *map_spec = DEFAULT_SHARD_MAP;
+    int c;
+    while ((c = getopt(argc, argv, "m:c:x")) != -1) {
+        switch (c) {
+            case 'm': map_spec = optarg; break;
+            case 'c': num_conns = atoi(optarg); break;
+            case 'x': max_speed = 1; break;
+            default: break;
+        }
+    }
+    if (optind >= argc || num_conns <= 0 || shard_map_parse(&shard_map, map_spec) != 0) {
+        fprintf(stderr, "Usage: %s [-m host:port:first:count,...] [-c connections] [-x] trace_file\n", argv[0]);
+        return 1;
+    }
+
+    records = trace_load(argv[optind], &trace_hdr, &initial_balances, &final_balances, &num_records);
+    if (!records) { fprintf(stderr, "Cannot read trace %s\n", argv[optind]); return 1; }
+    if (num_records == 0) { printf("Trace is empty\n"); return 0; }
+
+    //The replay only reproduces the capture on a ledger that starts where it started
+    int diffs = verify_balances(initial_balances);
+    if (diffs != 0) {
+        if (diffs < 0) printf("起始餘額核對: 無法讀取伺服器帳本\n");
+        else printf("起始餘額核對: MISMATCH (%d 個帳戶不同), 請以錄製時的帳本 (-L) 重新啟動伺服器\n", diffs);
+        return 1;
+    }
+
+    first_ts = last_ts = records[0].ts_ns;
+    for (long i = 1; i < num_records; i++) {
+        if (records[i].ts_ns < first_ts) first_ts = records[i].ts_ns;
+        if (records[i].ts_ns > last_ts) last_ts = records[i].ts_ns;
+    }
+    qsort(records, num_records, sizeof(TraceRecord), compare_records);
+    build_dependencies();
+
+    //Group record indices by connection (counting sort keeps apply order within a connection)
+    by_conn = malloc(num_records * sizeof(long));
+    conn_start = calloc(num_conns + 1, sizeof(long));
+    for (long i = 0; i < num_records; i++) conn_start[records[i].account_id % num_conns + 1]++;
+    for (int i = 0; i < num_conns; i++) conn_start[i + 1] += conn_start[i];
+    long *fill = malloc(num_conns * sizeof(long));
+    memcpy(fill, conn_start, num_conns * sizeof(long));
+    for (long i = 0; i < num_records; i++) by_conn[fill[records[i].account_id % num_conns]++] = i;
+    free(fill);
+    latencies = malloc(num_records * sizeof(long long));
+
+    printf("========================================\n");
+    printf("[Replay] %ld 筆請求, %d 條連線, %s\n", num_records, num_conns, max_speed ? "全速" : "原始節奏");
+    printf("========================================\n");
+
+    start_ns = now_ns();
+    pthread_t *threads = malloc(num_conns * sizeof(pthread_t));
+    for (int i = 0; i < num_conns; i++) {
+        int *arg = malloc(sizeof(int));
+        *arg = i;
+        pthread_create(&threads[i], NULL, replay_task, arg);
+    }
+    for (int i = 0; i < num_conns; i++) pthread_join(threads[i], NULL);
+    double elapsed_sec = (now_ns() - start_ns) / 1e9;
+
+    //Latency percentiles over the successful requests
+    long ok = 0;
+    long long total_latency_ns = 0;
+    for (long i = 0; i < num_records; i++) {
+        if (latencies[i] < 0) continue;
+        latencies[ok++] = latencies[i];
+        total_latency_ns += latencies[i];
+    }
+    qsort(latencies, ok, sizeof(long long), compare_ll);
+
+    printf("\n========== [Replay 統計] ==========\n");
+    printf("成功/總筆數: %ld / %ld (略過錄製時過載拒絕的 %lld 筆)\n", ok, num_records, skipped);
+    printf("總耗時: %.3f 秒 (錄製時 %.3f 秒)\n", elapsed_sec, (last_ts - first_ts) / 1e9);
+    printf("整體 Throughput (TPS): %.2f 交易/秒\n", elapsed_sec > 0 ? ok / elapsed_sec : 0);
+    if (ok > 0) {
+        printf("平均延遲: %.3f ms\n", (double)total_latency_ns / ok / 1e6);
+        printf("p50 延遲: %.3f ms, p99 延遲: %.3f ms\n",
+               latencies[ok / 2] / 1e6, latencies[(ok * 99) / 100] / 1e6);
+    }
+    printf("回應狀態與錄製不同: %lld 筆\n", status_mismatches);
+
+    if (final_balances) {
+        diffs = verify_balances(final_balances);
+        if (diffs < 0) printf("最終餘額核對: 無法讀取伺服器帳本\n");
+        else printf("最終餘額核對: %s (%d 個帳戶不同)\n", diffs == 0 ? "OK" : "MISMATCH", diffs);
+    } else {
+        printf("最終餘額核對: 略過 (錄製未正常結束)\n");
+    }
+    printf("===================================\n");
+
+    return (failures == 0 && status_mismatches == 0 && diffs == 0) ? 0 : 1;
+}
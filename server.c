@@ -12,26 +12,77 @@
 #include <time.h>
 #include <netinet/tcp.h>
 #include <stdarg.h>
+#include <poll.h>
 //#include "bank_lib.h"
 #include "models.h"
 #include "protocol.h"
 #include "security.h"
 #include "bank_core.h"
+#include "shard.h"
+#include "repl.h"
+#include "trace.h"
+#include "loader.h"
+#include "perfcount.h"
+#include "batch.h"
+#include "admit.h"
 
 Bank *bank; //Pointer to the Shared Memory region accessible by all processes
 static int server_fd; //Flag to control the server shutdown loop
+static int peer_fd; //Listening socket for shard-to-shard (2PC) sessions
+static int repl_fd; //Listening socket for followers pulling the change log
 volatile sig_atomic_t stop_server = 0;
+volatile sig_atomic_t promote_requested = 0;
 
-#define MAX_USERS 100
+#define WORKER_PROCESSES 10
+#define PEER_WORKERS 4
+#define REPL_SENDERS 4 //Maximum number of followers served at once
+#define SHEDDER_SESSIONS 2 //Sessions the shedder serves itself at once (see shedder_loop)
 
-//Structure to hold mock user database in memory
-typedef struct {
-    char username[LOGIN_USERNAME_LEN];
-    char password[LOGIN_PASSWORD_LEN];
-    int account_id;
-} UserInfo;
+//Sharding configuration (a single shard owning every account by default)
+static ShardMap shard_map;
+static int shard_idx = 0;
+static char shm_name[64] = SHM_NAME;
+static char log_name[64] = "transaction.log";
+
+//Replication configuration: a follower streams from the primary at follow_host:follow_port
+static char follow_host[SHARD_HOST_LEN];
+static int follow_port = 0;
+
+//Workload capture (-T): decoded client requests are appended to this trace file
+static int trace_fd = -1;
+
+//Admission control thresholds (-Q, -W, -r); all off by default
+static AdmitConfig admit_cfg;
+
+//Password of 2PC sessions between shards (PEER_SECRET_ENV); empty disables them
+static char peer_secret[LOGIN_PASSWORD_LEN];
+
+//Who logged in on a peer port (in place of an account ID)
+#define PEER_ADMIN -1 //Audit, status, batch jobs and replication streams
+#define PEER_SHARD -2 //Another shard: may also PREPARE/COMMIT/ABORT credits
+
+//dTLB load-miss counter covering this process and every child (-1 if unavailable)
+static int tlb_fd = -1;
 
-UserInfo users[MAX_USERS];
+//Every forked child, so shutdown can stop them before the final report
+static pid_t children[WORKER_PROCESSES + PEER_WORKERS + REPL_SENDERS + 1];
+static int num_children = 0;
+
+/*
+Mock user database: user<N> with password pass<N> owns account N.
+Credentials are derived from the account ID instead of being stored, so a
+ledger of millions of accounts adds nothing to startup time.
+Returns the account ID, or -1 if the login is invalid for this shard.
+ */
+int lookup_user(const char *username, const char *password) {
+    int id;
+    if (sscanf(username, "user%d", &id) != 1 || bank_account(bank, id) == NULL) return -1;
+    char expected_user[LOGIN_USERNAME_LEN], expected_pass[LOGIN_PASSWORD_LEN];
+    snprintf(expected_user, sizeof(expected_user), "user%d", id);
+    snprintf(expected_pass, sizeof(expected_pass), "pass%d", id);
+    if (strcmp(username, expected_user) != 0 || strcmp(password, expected_pass) != 0) return -1;
+    return id;
+}
 
 /* ================= Console Mutex ================= */
 //Mutex to ensure thread-safe printing to stdout
@@ -54,43 +105,171 @@ void print_server_console_log(const char *fmt, ...) {
 /* ================= Signal Handler ================= */
 //Handles SIGINT (Ctrl+C) to gracefully stop the server
 void handle_sigint(int sig) { (void)sig; stop_server = 1; }
+//Handles SIGUSR1 on a follower: promote it to a writable primary
+void handle_sigusr1(int sig) { (void)sig; promote_requested = 1; }
+
+/* ================= Transaction Log ================= */
+//Appends one timestamped record to the transaction log under log_lock.
+//If count_tx is set, the record also counts as a completed transaction.
+void write_log(FILE *log_fp, int count_tx, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    pthread_mutex_lock(&bank->log_lock);
+    if (count_tx) bank->total_tx_count++;
+    if (log_fp) {
+        time_t now = time(NULL);
+        char *time_str = ctime(&now);
+        time_str[strlen(time_str)-1] = '\0';
+        if (count_tx) fprintf(log_fp, "[%s] #%lld ", time_str, bank->total_tx_count);
+        else fprintf(log_fp, "[%s] ", time_str);
+        vfprintf(log_fp, fmt, args);
+        fprintf(log_fp, "\n");
+        fflush(log_fp);
+    }
+    pthread_mutex_unlock(&bank->log_lock);
+    va_end(args);
+}
 
 /* ================= Init Bank ================= */
-//Initializes Shared Memory, Mutexes, and Mock User Data
-void init_bank() {
-    //Create or open the shared memory object
-    int fd = shm_open(SHM_NAME, O_CREAT | O_RDWR, 0666);
-    if (fd < 0) { perror("shm_open"); exit(1); }
-    //Set the size of the shared memory object
-    if (ftruncate(fd, sizeof(Bank)) == -1) { perror("ftruncate"); exit(1); }
+//Initializes Shared Memory and Mutexes, optionally bulk-loading balances from an account file.
+//A shard with count 0 takes its account range from the file.
+void init_bank(const char *account_file, int huge_pages) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    ShardInfo *me = &shard_map.shards[shard_idx];
+
+    //Bulk load: starting balances come from the file instead of INITIAL_BALANCE
+    long long *balances = NULL;
+    if (account_file) {
+        balances = load_accounts(account_file, &me->first_id, &me->count, threads);
+        if (!balances) { fprintf(stderr, "Cannot load accounts from %s\n", account_file); exit(1); }
+    }
 
     //Map the shared memory into this process's address space
-    bank = mmap(NULL, sizeof(Bank), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (bank == MAP_FAILED) { perror("mmap"); exit(1); }
+    int used_huge = 0;
+    bank = bank_map(shm_name, me->count, huge_pages, &used_huge);
+    if (!bank) { perror("bank_map"); exit(1); }
 
-    //Initialize bank data (accounts, balances, mutex attributes)
-    bank_init(bank);
+    //Initialize bank data (accounts, balances, mutex attributes) for this shard's range
+    bank_init(bank, me->first_id, me->count, balances, threads);
+    free(balances);
 
-    //Initialize mock users (user0 -> pass0 -> account 0)
-    for (int i = 0; i < MAX_USERS; i++) {
-        snprintf(users[i].username, LOGIN_USERNAME_LEN, "user%d", i);
-        snprintf(users[i].password, LOGIN_PASSWORD_LEN, "pass%d", i);
-        users[i].account_id = i;
-    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double startup_ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
 
     //Initialize the transaction log file
-    FILE *fp = fopen("transaction.log", "w");
+    FILE *fp = fopen(log_name, "w");
     if (fp) { fprintf(fp, "=== Mutex Bank Transaction Log Started ===\n"); fclose(fp); }
 
     print_server_console_log("Mutex Bank Server Starting...");
-    print_server_console_log("Shared memory initialized");
-    print_server_console_log("Listening on port %d", PORT);
+    print_server_console_log("Shared memory initialized: %d accounts in %.1f ms (%d threads, %s)",
+                             bank->num_accounts, startup_ms, threads,
+                             used_huge ? "2 MiB huge pages" : huge_pages ? "no huge pages reserved, 4 KiB pages" : "4 KiB pages");
+    print_server_console_log("Shard %d/%d owns accounts %d..%d", shard_idx, shard_map.n,
+                             me->first_id, me->first_id + me->count - 1);
+    print_server_console_log("Listening on port %d (peer port %d)", me->port, me->port + PEER_PORT_OFFSET);
     print_server_console_log("Waiting for clients...");
 }
 
+/* ================= Cross-Shard Transfer (2PC Coordinator) ================= */
+/*
+Delivers a 2PC decision (req->op is OP_COMMIT or OP_ABORT) to the participant,
+reopening the peer session after every failure with an increasing delay.
+'sock' is the session the transaction was prepared on (closed here). Gives up
+after 'attempts' tries, or never if 'attempts' is 0. Returns 0 once acknowledged.
+ */
+int send_decision(ShardInfo *peer, int sock, Request *req, int attempts, FILE *log_fp) {
+    const char *name = req->op == OP_COMMIT ? "COMMIT" : "ABORT";
+    int delay_ms = 10;
+    for (int n = 1; ; n++) {
+        Response res = {0};
+        int acked = sock >= 0 && shard_call(sock, req, &res) == 0 && res.status == RES_OK;
+        if (sock >= 0) close(sock);
+        if (acked) {
+            if (n > 1) write_log(log_fp, 0, "2PC %s tx=%llx acknowledged after %d attempts", name, req->txid, n);
+            return 0;
+        }
+        if (attempts > 0 && n >= attempts) return -1;
+        if (n == 1) write_log(log_fp, 0, "2PC %s tx=%llx unacknowledged, retrying on shard %s:%d",
+                              name, req->txid, peer->host, peer->port);
+        usleep(delay_ms * 1000);
+        if (delay_ms < 1000) delay_ms *= 2;
+        sock = shard_open_session(peer->host, peer->port + PEER_PORT_OFFSET, PEER_USERNAME, peer_secret);
+    }
+}
+
+/*
+Transfers to an account owned by another shard use two-phase commit.
+The shard owning the source account coordinates: it reserves the debit locally,
+asks the destination shard to PREPARE the credit, then COMMITs or ABORTs.
+The source lock is only held while reserving, never across the network, so a
+slow peer cannot stall other transactions on this shard.
+Once the participant has voted yes it can no longer abort on its own, so the
+COMMIT is retried until acknowledged and only then is the transfer reported done.
+'*seq' is set to the sequence number of the debit (see handle_transfer).
+*/
+void cross_shard_transfer(Account *src, int dst_id, int amt, Response *res, FILE *log_fp, long long *seq) {
+    if (amt <= 0) {
+        res->status = RES_ERROR;
+        strcpy(res->msg, "Invalid Amount");
+        return;
+    }
+    long long txid = ((long long)shard_idx << 48) | __sync_add_and_fetch(&bank->next_txid, 1);
+
+    //Reserve the funds on the source account
+    pthread_mutex_lock(&src->lock);
+    if (src->balance < amt) {
+        *seq = bank->repl_head;
+        pthread_mutex_unlock(&src->lock);
+        res->status = RES_NO_FUNDS;
+        strcpy(res->msg, "No Funds");
+        return;
+    }
+    src->balance -= amt;
+    long long remaining = src->balance;
+    *seq = repl_append(bank, src->id, -1, amt);
+    pthread_mutex_unlock(&src->lock);
+    write_log(log_fp, 0, "2PC PREPARE tx=%llx debit Acc %02d ($%d) -> Acc %02d", txid, src->id, amt, dst_id);
+
+    //Phase 1: ask the owning shard to prepare the credit
+    ShardInfo *peer = &shard_map.shards[shard_for_account(&shard_map, dst_id)];
+    Request preq = { .src_id = src->id, .dst_id = dst_id, .amount = amt, .op = OP_PREPARE, .txid = txid };
+    Response pres = {0};
+    int sock = shard_open_session(peer->host, peer->port + PEER_PORT_OFFSET, PEER_USERNAME, peer_secret);
+    int voted_yes = sock >= 0 && shard_call(sock, &preq, &pres) == 0 && pres.status == RES_OK;
+
+    if (!voted_yes) {
+        //Abort: give the reserved funds back
+        pthread_mutex_lock(&src->lock);
+        src->balance += amt;
+        repl_append(bank, -1, src->id, amt);
+        pthread_mutex_unlock(&src->lock);
+        write_log(log_fp, 0, "2PC ABORT tx=%llx", txid);
+        //The PREPARE may have reached the participant even if its vote did not reach us
+        preq.op = OP_ABORT;
+        if (sock >= 0 && send_decision(peer, sock, &preq, 3, log_fp) != 0)
+            write_log(log_fp, 0, "2PC ABORT-UNACKED tx=%llx (shard %s:%d keeps it in doubt)", txid, peer->host, peer->port);
+        res->status = RES_ERROR;
+        strcpy(res->msg, "Cross-shard Transfer Aborted");
+        return;
+    }
+
+    //Phase 2: the participant voted yes, so the decision is COMMIT
+    write_log(log_fp, 1, "2PC COMMIT tx=%llx Transfer: Acc %02d -> Acc %02d ($%d)", txid, src->id, dst_id, amt);
+    preq.op = OP_COMMIT;
+    send_decision(peer, sock, &preq, 0, log_fp);
+
+    res->status = RES_OK;
+    res->balance = remaining;
+    strcpy(res->msg, "Transfer OK");
+}
+
 /* ================= Transfer Handler ================= */
-//Handles money transfer between two accounts with Row-Level Locking
-void handle_transfer(int client_sock, Request *req, FILE *log_fp) {
+//Handles money transfer between two accounts with Row-Level Locking.
+//The write handlers set '*seq' under the account lock(s): the sequence number of the
+//change they applied, or else the next one (the point in the apply order they observed).
+ResCode handle_transfer(int client_sock, Request *req, FILE *log_fp, long long *seq) {
     Response res = {0};
     struct timespec start, end;
     //Start timing for latency metric
@@ -100,47 +279,53 @@ void handle_transfer(int client_sock, Request *req, FILE *log_fp) {
     int u2 = req->dst_id;
     int amt = req->amount;
 
-    if (u1 < 0 || u1 >= MAX_ACCOUNTS || u2 < 0 || u2 >= MAX_ACCOUNTS) {
+    Account *src = bank_account(bank, u1);
+    Account *dst = bank_account(bank, u2);
+
+    if (src == NULL || shard_for_account(&shard_map, u2) < 0) {
         res.status = RES_ERROR;
         strcpy(res.msg, "Invalid ID");
+    } else if (u1 == u2) {
+        //Would lock the same (non-recursive) mutex twice
+        res.status = RES_ERROR;
+        strcpy(res.msg, "Self Transfer");
+    } else if (amt <= 0) {
+        res.status = RES_ERROR;
+        strcpy(res.msg, "Invalid Amount");
+    } else if (dst == NULL) {
+        //Destination lives on another shard
+        cross_shard_transfer(src, u2, amt, &res, log_fp, seq);
     } else {
         //Deadlock Prevention: Always lock the smaller ID first
-        int first = (u1 < u2) ? u1 : u2;
-        int second = (u1 < u2) ? u2 : u1;
+        Account *first = (u1 < u2) ? src : dst;
+        Account *second = (u1 < u2) ? dst : src;
 
-        pthread_mutex_lock(&bank->accounts[first].lock);
-        pthread_mutex_lock(&bank->accounts[second].lock);
+        pthread_mutex_lock(&first->lock);
+        pthread_mutex_lock(&second->lock);
 
         //Critical Section: Check balance and update
-        if (bank->accounts[u1].balance >= amt) {
-            bank->accounts[u1].balance -= amt;
-            bank->accounts[u2].balance += amt;
+        if (src->balance >= amt) {
+            src->balance -= amt;
+            dst->balance += amt;
+            *seq = repl_append(bank, u1, u2, amt);
             res.status = RES_OK;
-            res.balance = bank->accounts[u1].balance;
+            res.balance = src->balance;
             strcpy(res.msg, "Transfer OK");
 
-            //Lock global log mutex to update statistics and write to file
-            pthread_mutex_lock(&bank->log_lock);
-            bank->total_tx_count++;
-            if (log_fp) {
-                time_t now = time(NULL);
-                char *time_str = ctime(&now);
-                time_str[strlen(time_str)-1] = '\0';
-                fprintf(log_fp, "[%s] #%lld Transfer: Acc %02d -> Acc %02d ($%d)\n",
-                        time_str, bank->total_tx_count, u1, u2, amt);
-                fflush(log_fp);
-            }
-            pthread_mutex_unlock(&bank->log_lock);
+            //Update statistics and write to file
+            write_log(log_fp, 1, "Transfer: Acc %02d -> Acc %02d ($%d)", u1, u2, amt);
         } else {
+            *seq = bank->repl_head;
             res.status = RES_NO_FUNDS;
             strcpy(res.msg, "No Funds");
         }
 
-        pthread_mutex_unlock(&bank->accounts[second].lock);
-        pthread_mutex_unlock(&bank->accounts[first].lock);
+        pthread_mutex_unlock(&second->lock);
+        pthread_mutex_unlock(&first->lock);
     }
 
     //Encrypt response with XOR and send
+    ResCode status = res.status;
     xor_cipher(&res, sizeof(Response));
     send_packet(client_sock, &res, sizeof(Response));
 
@@ -148,210 +333,822 @@ void handle_transfer(int client_sock, Request *req, FILE *log_fp) {
     clock_gettime(CLOCK_MONOTONIC, &end);
     long latency_ns = (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
     __sync_fetch_and_add(&bank->total_latency_ns, latency_ns);
+    return status;
 }
 
 /* ================= Deposit Handler ================= */
-void handle_deposit(int client_sock, Request *req, FILE *log_fp) {
+ResCode handle_deposit(int client_sock, Request *req, FILE *log_fp, long long *seq) {
     Response res = {0};
     int acc = req->src_id;
     int amt = req->amount;
 
+    Account *a = bank_account(bank, acc);
+
     //Lock specific account
-    pthread_mutex_lock(&bank->accounts[acc].lock);
-    bank->accounts[acc].balance += amt;
+    pthread_mutex_lock(&a->lock);
+    a->balance += amt;
+    *seq = repl_append(bank, -1, acc, amt);
     res.status = RES_OK;
-    res.balance = bank->accounts[acc].balance;
+    res.balance = a->balance;
     strcpy(res.msg, "Deposit OK");
-    pthread_mutex_unlock(&bank->accounts[acc].lock);
+    pthread_mutex_unlock(&a->lock);
 
     //Update global stats
-    pthread_mutex_lock(&bank->log_lock);
-    bank->total_tx_count++;
-    if (log_fp) {
-        time_t now = time(NULL);
-        char *time_str = ctime(&now);
-        time_str[strlen(time_str)-1] = '\0';
-        fprintf(log_fp, "[%s] #%lld Deposit: Acc %02d ($%d)\n",
-                time_str, bank->total_tx_count, acc, amt);
-        fflush(log_fp);
-    }
-    pthread_mutex_unlock(&bank->log_lock);
+    write_log(log_fp, 1, "Deposit: Acc %02d ($%d)", acc, amt);
 
+    ResCode status = res.status;
     xor_cipher(&res, sizeof(Response));
     send_packet(client_sock, &res, sizeof(Response));
+    return status;
 }
 
 /* ================= Withdraw Handler ================= */
-void handle_withdraw(int client_sock, Request *req, FILE *log_fp) {
+ResCode handle_withdraw(int client_sock, Request *req, FILE *log_fp, long long *seq) {
     Response res = {0};
     int acc = req->src_id;
     int amt = req->amount;
 
-    pthread_mutex_lock(&bank->accounts[acc].lock);
-    if (bank->accounts[acc].balance >= amt) {
-        bank->accounts[acc].balance -= amt;
+    Account *a = bank_account(bank, acc);
+
+    pthread_mutex_lock(&a->lock);
+    if (a->balance >= amt) {
+        a->balance -= amt;
+        *seq = repl_append(bank, acc, -1, amt);
         res.status = RES_OK;
-        res.balance = bank->accounts[acc].balance;
+        res.balance = a->balance;
         strcpy(res.msg, "Withdraw OK");
     } else {
+        *seq = bank->repl_head;
         res.status = RES_NO_FUNDS;
         strcpy(res.msg, "Insufficient Funds");
     }
-    pthread_mutex_unlock(&bank->accounts[acc].lock);
+    pthread_mutex_unlock(&a->lock);
 
-    pthread_mutex_lock(&bank->log_lock);
-    bank->total_tx_count++;
-    if (log_fp) {
-        time_t now = time(NULL);
-        char *time_str = ctime(&now);
-        time_str[strlen(time_str)-1] = '\0';
-        fprintf(log_fp, "[%s] #%lld Withdraw: Acc %02d ($%d)\n",
-                time_str, bank->total_tx_count, acc, amt);
-        fflush(log_fp);
-    }
-    pthread_mutex_unlock(&bank->log_lock);
+    write_log(log_fp, 1, "Withdraw: Acc %02d ($%d)", acc, amt);
 
+    ResCode status = res.status;
     xor_cipher(&res, sizeof(Response));
     send_packet(client_sock, &res, sizeof(Response));
+    return status;
 }
 
-/* ================= Worker Loop ================= */
-//Main loop for child processes
-void worker_loop(int server_fd) {
-    signal(SIGINT, SIG_DFL);
-    FILE *log_fp = fopen("transaction.log", "a");
+/* ================= Batch Posting ================= */
+static const char *batch_rule_name(OpCode op) {
+    return op == OP_BATCH_RATE ? "RATE" : op == OP_BATCH_FEE ? "FEE" : "BONUS";
+}
 
-    while (1) {
-        struct sockaddr_in addr;
-        socklen_t len = sizeof(addr);
-        //Accept new connection (Preforking: OS handles load balancing)
-        int client_sock = accept(server_fd, (struct sockaddr*)&addr, &len);
-        if (client_sock < 0) continue;
+/*
+Runs an interest/fee/bonus job over this shard's part of [src_id, dst_id] while
+live traffic continues, writing one summary record per partition to the log.
+The response carries the number of accounts processed and the net amount posted.
+ */
+void handle_batch(Request *req, Response *res, FILE *log_fp) {
+    if (bank->read_only || req->amount < 0 || req->src_id > req->dst_id) {
+        res->status = RES_ERROR;
+        strcpy(res->msg, "Batch Refused");
+        return;
+    }
+    BatchRule rule = { req->op, req->src_id, req->dst_id, req->amount, req->param };
+    BatchPartition parts[MAX_BATCH_PARTITIONS];
+    int partitions = sysconf(_SC_NPROCESSORS_ONLN);
+    if (partitions > MAX_BATCH_PARTITIONS) partitions = MAX_BATCH_PARTITIONS;
 
-        //Configure TCP Keep-alive and Timeouts
-        int keep = 1;
-        setsockopt(client_sock, SOL_SOCKET, SO_KEEPALIVE, &keep, sizeof(keep));
-        int idle = 5, interval = 3, maxpkt = 3;
-        setsockopt(client_sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
-        setsockopt(client_sock, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
-        setsockopt(client_sock, IPPROTO_TCP, TCP_KEEPCNT, &maxpkt, sizeof(maxpkt));
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int n = batch_post(bank, &rule, partitions, parts);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
 
-        struct timeval tv = {3, 0};
-        setsockopt(client_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-        setsockopt(client_sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    long long processed = 0, posted = 0, net = 0, overflowed = 0;
+    for (int p = 0; p < n; p++) {
+        write_log(log_fp, 0, "BATCH %s(%lld) part %d/%d Acc %02d..%02d: %lld accounts, %lld posted, net $%lld, %lld skipped (overflow), waited %lld ms for followers",
+                  batch_rule_name(rule.op), rule.value, p + 1, n, parts[p].first_id, parts[p].last_id,
+                  parts[p].processed, parts[p].posted, parts[p].net, parts[p].overflowed, parts[p].throttled_ms);
+        processed += parts[p].processed;
+        posted += parts[p].posted;
+        net += parts[p].net;
+        overflowed += parts[p].overflowed;
+    }
+    double rate = elapsed > 0 ? processed / elapsed : 0;
+    print_server_console_log("[BATCH] %s(%lld): %lld accounts (%lld posted, net $%lld, %lld skipped on overflow) in %.1f ms, %.0f accounts/s",
+                             batch_rule_name(rule.op), rule.value, processed, posted, net, overflowed, elapsed * 1000, rate);
 
-        //Authentication Phase (AES Encryption)
-        LoginRequest login_req;
-        unsigned char encrypted_req[sizeof(LoginRequest)] = {0};
-        int ret = recv_packet(client_sock, encrypted_req, sizeof(LoginRequest));
-        if (ret <= 0) { close(client_sock); continue; }
+    res->status = RES_OK;
+    res->balance = net;
+    snprintf(res->msg, sizeof(res->msg), "%lld accounts %lld posted %.0f/s", processed, posted, rate);
+}
 
-        //Decrypt login credentials using AES
-        aes_decrypt(encrypted_req, &login_req, sizeof(LoginRequest));
+/* ================= Peer Handler (2PC Participant) ================= */
+//Looks up a transaction in the shared prepared table. Caller holds bank->tx_lock.
+PreparedTx *find_tx(long long txid) {
+    for (int i = 0; i < MAX_PREPARED_TX; i++) {
+        PreparedTx *tx = &bank->prepared_tx[i];
+        if (tx->state != TX_FREE && tx->txid == txid) return tx;
+    }
+    return NULL;
+}
 
-        int valid = 0, account_id = -1;
-        //Verify credentials against memory DB
-        for (int i = 0; i < MAX_USERS; i++) {
-            if (strcmp(users[i].username, login_req.username) == 0 &&
-                strcmp(users[i].password, login_req.password) == 0) {
-                valid = 1;
-                account_id = users[i].account_id;
-                break;
+//Takes a free slot, else the one finished longest ago. Prepared entries are never
+//reused. Returns NULL if every slot holds a prepared transaction. Caller holds bank->tx_lock.
+PreparedTx *alloc_tx(long long txid) {
+    PreparedTx *victim = NULL;
+    for (int i = 0; i < MAX_PREPARED_TX; i++) {
+        PreparedTx *tx = &bank->prepared_tx[i];
+        if (tx->state == TX_FREE) { victim = tx; break; }
+        if (tx->state != TX_PREPARED && (victim == NULL || tx->stamp < victim->stamp)) victim = tx;
+    }
+    if (victim) *victim = (PreparedTx){ .txid = txid };
+    return victim;
+}
+
+//Number of credits voted yes on but not yet committed or aborted
+int count_in_doubt() {
+    int n = 0;
+    pthread_mutex_lock(&bank->tx_lock);
+    for (int i = 0; i < MAX_PREPARED_TX; i++) n += bank->prepared_tx[i].state == TX_PREPARED;
+    pthread_mutex_unlock(&bank->tx_lock);
+    return n;
+}
+
+//Handles requests on the peer port: PREPARE/COMMIT/ABORT of cross-shard credits
+//(only from another shard, 'from_shard'), AUDIT, STATUS and batch jobs
+void handle_peer_request(int client_sock, Request *req, FILE *log_fp, int from_shard) {
+    Response res = {0};
+    Account *a = bank_account(bank, req->dst_id);
+    PreparedTx *tx;
+
+    //A COMMIT credits money that was debited on another shard: only shards may send one
+    if (!from_shard && (req->op == OP_PREPARE || req->op == OP_COMMIT || req->op == OP_ABORT)) {
+        res.status = RES_ERROR;
+        strcpy(res.msg, "Shards Only");
+        xor_cipher(&res, sizeof(Response));
+        send_packet(client_sock, &res, sizeof(Response));
+        return;
+    }
+
+    switch (req->op) {
+        case OP_PREPARE:
+            //Credits cannot fail, so voting yes only requires owning the account
+            //(and a txid not already decided, e.g. aborted before its PREPARE arrived)
+            res.status = RES_ERROR;
+            strcpy(res.msg, "Prepare Refused");
+            if (a == NULL || req->amount <= 0 || bank->read_only) break;
+            pthread_mutex_lock(&bank->tx_lock);
+            tx = find_tx(req->txid) ? NULL : alloc_tx(req->txid);
+            if (tx) {
+                *tx = (PreparedTx){ req->txid, req->src_id, req->dst_id, req->amount, TX_PREPARED, 0 };
+                res.status = RES_OK;
+                strcpy(res.msg, "Prepared");
             }
+            pthread_mutex_unlock(&bank->tx_lock);
+            if (res.status == RES_OK)
+                write_log(log_fp, 0, "2PC PREPARE tx=%llx credit Acc %02d ($%d) <- Acc %02d",
+                          req->txid, req->dst_id, req->amount, req->src_id);
+            break;
+        case OP_COMMIT:
+            //Idempotent: the coordinator retries until it sees an acknowledgement
+            pthread_mutex_lock(&bank->tx_lock);
+            tx = find_tx(req->txid);
+            if (tx && tx->state == TX_ABORTED) {
+                res.status = RES_ERROR;
+                strcpy(res.msg, "Transaction Aborted");
+            } else if (tx && tx->state == TX_PREPARED) {
+                a = bank_account(bank, tx->dst_id);
+                pthread_mutex_lock(&a->lock);
+                a->balance += tx->amount;
+                repl_append(bank, -1, tx->dst_id, tx->amount);
+                res.balance = a->balance;
+                pthread_mutex_unlock(&a->lock);
+                tx->state = TX_COMMITTED;
+                tx->stamp = ++bank->tx_clock;
+                write_log(log_fp, 0, "2PC COMMIT tx=%llx credit Acc %02d ($%d)", tx->txid, tx->dst_id, tx->amount);
+                res.status = RES_OK;
+                strcpy(res.msg, "Committed");
+            } else {
+                //Committed by an earlier attempt (its entry may since have been reused:
+                //a COMMIT is only ever sent for a transaction this shard prepared)
+                res.status = RES_OK;
+                strcpy(res.msg, "Already Committed");
+            }
+            pthread_mutex_unlock(&bank->tx_lock);
+            break;
+        case OP_ABORT:
+            res.status = RES_OK;
+            strcpy(res.msg, "Aborted");
+            pthread_mutex_lock(&bank->tx_lock);
+            tx = find_tx(req->txid);
+            if (tx && tx->state == TX_COMMITTED) {
+                res.status = RES_ERROR;
+                strcpy(res.msg, "Transaction Committed");
+            } else if (tx == NULL || tx->state == TX_PREPARED) {
+                //Unknown: remember the abort so a PREPARE still in flight is refused
+                if (tx == NULL) tx = alloc_tx(req->txid);
+                if (tx) {
+                    tx->state = TX_ABORTED;
+                    tx->stamp = ++bank->tx_clock;
+                }
+                write_log(log_fp, 0, "2PC ABORT tx=%llx", req->txid);
+            }
+            pthread_mutex_unlock(&bank->tx_lock);
+            break;
+        case OP_AUDIT: {
+            //Sum of all balances owned by this shard (used to check conservation of assets)
+            long long total = 0;
+            for (int i = 0; i < bank->num_accounts; i++) {
+                pthread_mutex_lock(&bank->accounts[i].lock);
+                total += bank->accounts[i].balance;
+                pthread_mutex_unlock(&bank->accounts[i].lock);
+            }
+            res.status = RES_OK;
+            res.balance = total;
+            strcpy(res.msg, "Audit OK");
+            break;
+        }
+        case OP_STATUS: {
+            //Replication metrics: lag in records, and time since the primary was last heard from
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long long now_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+            long long contact_ms = bank->repl_last_contact_ns ? (now_ns - bank->repl_last_contact_ns) / 1000000 : -1;
+            res.status = RES_OK;
+            res.balance = repl_lag(bank);
+            snprintf(res.msg, sizeof(res.msg), "%s seq=%lld lag=%lld contact=%lldms",
+                     bank->read_only ? "follower" : "primary", bank->repl_head, res.balance, contact_ms);
+            break;
         }
+        case OP_BATCH_RATE:
+        case OP_BATCH_FEE:
+        case OP_BATCH_BONUS:
+            handle_batch(req, &res, log_fp);
+            break;
+        default:
+            res.status = RES_ERROR;
+            strcpy(res.msg, "Invalid Operation");
+            break;
+    }
+
+    xor_cipher(&res, sizeof(Response));
+    send_packet(client_sock, &res, sizeof(Response));
+}
+
+/* ================= Balance Handler ================= */
+//Read-only query of the logged-in user's balance (the only operation followers accept)
+ResCode handle_balance(int client_sock, Request *req) {
+    Response res = {0};
+    Account *a = bank_account(bank, req->src_id);
+
+    pthread_mutex_lock(&a->lock);
+    res.balance = a->balance;
+    pthread_mutex_unlock(&a->lock);
+    res.status = RES_OK;
+    strcpy(res.msg, "Balance OK");
+
+    ResCode status = res.status;
+    xor_cipher(&res, sizeof(Response));
+    send_packet(client_sock, &res, sizeof(Response));
+    return status;
+}
 
-        LoginResponse login_res = {0};
-        if (!valid) {
-            login_res.success = 0;
-            strcpy(login_res.msg, "Login Failed");
-            print_server_console_log("[AUTH] Failed login attempt: User %s", login_req.username);
+/* ================= Session Setup ================= */
+/*
+Fast reject of a session shed by admission control: the login is discarded
+unread (a single recv; closing with unread data would reset the connection
+before the reply is read) and answered with a busy LoginResponse.
+ */
+void reject_session(int client_sock, int retry_ms) {
+    recv(client_sock, NULL, sizeof(LoginRequest) + 8, MSG_DONTWAIT | MSG_TRUNC);
+    LoginResponse busy = { .success = 0, .retry_after_ms = retry_ms };
+    snprintf(busy.msg, sizeof(busy.msg), "Busy, retry after %d ms", retry_ms);
+    unsigned char encrypted_busy[sizeof(LoginResponse)] = {0};
+    aes_encrypt(&busy, encrypted_busy, sizeof(LoginResponse));
+    send_packet(client_sock, encrypted_busy, sizeof(LoginResponse));
+    close(client_sock);
+}
+
+//Runs the AES login on an accepted connection. 'peer' sessions only admit other
+//servers of this deployment. Returns the logged-in socket, or -1 on failure.
+int login_session(int client_sock, int peer, int *account_id) {
+    //Configure TCP Keep-alive and Timeouts
+    int keep = 1;
+    setsockopt(client_sock, SOL_SOCKET, SO_KEEPALIVE, &keep, sizeof(keep));
+    int idle = 5, interval = 3, maxpkt = 3;
+    setsockopt(client_sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(client_sock, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(client_sock, IPPROTO_TCP, TCP_KEEPCNT, &maxpkt, sizeof(maxpkt));
+
+    struct timeval tv = {3, 0};
+    setsockopt(client_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(client_sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    //Authentication Phase (AES Encryption)
+    LoginRequest login_req;
+    unsigned char encrypted_req[sizeof(LoginRequest)] = {0};
+    int ret = recv_packet(client_sock, encrypted_req, sizeof(LoginRequest));
+    if (ret <= 0) { close(client_sock); return -1; }
+
+    //Decrypt login credentials using AES
+    aes_decrypt(encrypted_req, &login_req, sizeof(LoginRequest));
+
+    login_req.username[LOGIN_USERNAME_LEN - 1] = '\0';
+    login_req.password[LOGIN_PASSWORD_LEN - 1] = '\0';
+
+    int valid = 0;
+    *account_id = -1;
+    if (peer) {
+        //Peer ports accept other shards of this deployment (holding the runtime
+        //secret) and administrative tools, which are kept away from 2PC
+        if (strcmp(login_req.username, PEER_USERNAME) == 0) {
+            valid = peer_secret[0] != '\0' && strcmp(login_req.password, peer_secret) == 0;
+            *account_id = PEER_SHARD;
         } else {
-            login_res.success = 1;
-            strcpy(login_res.msg, "Login OK");
-            print_server_console_log("[AUTH] User %s connected, account=%d",
-                                     login_req.username, account_id);
+            valid = strcmp(login_req.username, ADMIN_USERNAME) == 0 &&
+                    strcmp(login_req.password, ADMIN_PASSWORD) == 0;
+            *account_id = PEER_ADMIN;
         }
+    } else {
+        //Verify credentials against memory DB
+        *account_id = lookup_user(login_req.username, login_req.password);
+        valid = *account_id >= 0;
+    }
+
+    LoginResponse login_res = {0};
+    if (!valid) {
+        login_res.success = 0;
+        strcpy(login_res.msg, "Login Failed");
+        print_server_console_log("[AUTH] Failed login attempt: User %s", login_req.username);
+    } else {
+        login_res.success = 1;
+        strcpy(login_res.msg, "Login OK");
+        if (!peer)
+            print_server_console_log("[AUTH] User %s connected, account=%d",
+                                     login_req.username, *account_id);
+    }
+
+    //Send encrypted response back
+    unsigned char encrypted_res[sizeof(LoginResponse)] = {0};
+    aes_encrypt(&login_res, encrypted_res, sizeof(LoginResponse));
+    send_packet(client_sock, encrypted_res, sizeof(LoginResponse));
+
+    if (!valid) { close(client_sock); return -1; }
+    return client_sock;
+}
+
+//Accepts one connection, applies admission control and logs it in.
+//Returns the logged-in socket, or -1 on failure.
+int accept_session(int listen_fd, int peer, int *account_id) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    //Accept new connection (Preforking: OS handles load balancing)
+    int client_sock = accept(listen_fd, (struct sockaddr*)&addr, &len);
+    if (client_sock < 0) return -1;
+
+    //Overloaded: turn the session away before spending any work on it
+    int retry_ms = peer ? 0 : admit_session(bank, &admit_cfg, listen_fd, client_sock);
+    if (retry_ms > 0) {
+        reject_session(client_sock, retry_ms);
+        return -1;
+    }
+    return login_session(client_sock, peer, account_id);
+}
 
-        //Send encrypted response back
-        unsigned char encrypted_res[sizeof(LoginResponse)] = {0};
-        aes_encrypt(&login_res, encrypted_res, sizeof(LoginResponse));
-        send_packet(client_sock, encrypted_res, sizeof(LoginResponse));
+/* ================= Error Reply ================= */
+ResCode send_error(int client_sock, const char *msg) {
+    Response res = { .status = RES_ERROR };
+    snprintf(res.msg, sizeof(res.msg), "%s", msg);
+    xor_cipher(&res, sizeof(Response));
+    send_packet(client_sock, &res, sizeof(Response));
+    return RES_ERROR;
+}
 
-        if (!valid) { close(client_sock); continue; }
+//Rejects a request with RES_BUSY; the retry delay goes in the balance field and the message
+ResCode send_busy(int client_sock, int retry_ms) {
+    Response res = { .status = RES_BUSY, .balance = retry_ms };
+    snprintf(res.msg, sizeof(res.msg), "Busy, retry after %d ms", retry_ms);
+    xor_cipher(&res, sizeof(Response));
+    send_packet(client_sock, &res, sizeof(Response));
+    return RES_BUSY;
+}
 
-        //Transaction Phase (XOR Encryption)
-        Request req;
-        ret = recv_packet(client_sock, &req, sizeof(req));
-        if (ret > 0) {
-            xor_cipher(&req, sizeof(Request));
-            req.src_id = account_id;
+/* ================= Worker Loop ================= */
+//Serves one logged-in session until the other side closes, then closes it.
+//'peer' sessions come from other shards instead of users.
+void serve_session(int client_sock, int peer, int account_id, FILE *log_fp) {
+    //Transaction Phase (XOR Encryption): serve requests until the other side closes
+    Request req;
+    int ret;
+    int served = 0;
+    while ((ret = recv_packet(client_sock, &req, sizeof(req))) > 0) {
+        xor_cipher(&req, sizeof(Request));
+        served++;
+        if (peer) { handle_peer_request(client_sock, &req, log_fp, account_id == PEER_SHARD); continue; }
+        req.src_id = account_id;
+
+        //Capture mode: note when the decoded request arrived. Requests that touch
+        //no account lock keep the apply-order position seen on arrival.
+        TraceRecord rec = { .account_id = account_id, .dst_id = req.dst_id,
+                            .amount = req.amount, .op = req.op, .seq = bank->repl_head };
+        if (trace_fd >= 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            rec.ts_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+        }
+
+        ResCode status;
+        int retry_ms;
+        if (bank->read_only && req.op != OP_BALANCE) {
+            status = send_error(client_sock, "Read-only Replica");
+        } else if ((retry_ms = admit_request(bank, &admit_cfg, bank_account(bank, account_id))) > 0) {
+            status = send_busy(client_sock, retry_ms);
+        } else {
             switch (req.op) {
-                case OP_TRANSFER: handle_transfer(client_sock, &req, log_fp); break;
-                case OP_DEPOSIT:  handle_deposit(client_sock, &req, log_fp); break;
-                case OP_WITHDRAW: handle_withdraw(client_sock, &req, log_fp); break;
-                default:
-                    { Response res = {.status=RES_ERROR}; strcpy(res.msg,"Invalid Operation");
-                      xor_cipher(&res,sizeof(Response)); send_packet(client_sock,&res,sizeof(Response)); }
-                    break;
+                case OP_TRANSFER: status = handle_transfer(client_sock, &req, log_fp, &rec.seq); break;
+                case OP_DEPOSIT:  status = handle_deposit(client_sock, &req, log_fp, &rec.seq); break;
+                case OP_WITHDRAW: status = handle_withdraw(client_sock, &req, log_fp, &rec.seq); break;
+                case OP_BALANCE:  status = handle_balance(client_sock, &req); break;
+                default:          status = send_error(client_sock, "Invalid Operation"); break;
             }
-        } else {
-            Response res = { .status = RES_ERROR };
-            strcpy(res.msg, "Packet Error / Timeout");
-            xor_cipher(&res, sizeof(Response));
-            send_packet(client_sock, &res, sizeof(Response));
         }
 
-        close(client_sock);
+        if (trace_fd >= 0) {
+            rec.status = status;
+            trace_write(trace_fd, &rec);
+        }
+    }
+    if (served == 0) send_error(client_sock, "Packet Error / Timeout");
+    //A transaction prepared on this session stays in bank->prepared_tx: once this
+    //shard has voted yes, only the coordinator's decision may finish it
+
+    close(client_sock);
+}
+
+//Main loop for child processes. 'peer' workers serve other shards instead of users.
+void worker_loop(int server_fd, int peer) {
+    signal(SIGINT, SIG_DFL);
+    FILE *log_fp = fopen(log_name, "a");
+
+    while (1) {
+        int account_id;
+        int client_sock = accept_session(server_fd, peer, &account_id);
+        if (client_sock < 0) continue;
+        serve_session(client_sock, peer, account_id, log_fp);
     }
 
     if (log_fp) fclose(log_fp);
 }
 
+void worker_loop_users(int listen_fd) { worker_loop(listen_fd, 0); }
+void worker_loop_peers(int listen_fd) { worker_loop(listen_fd, 1); }
+
+//A session the shedder accepted but may not reject, served on its own thread
+typedef struct { int sock; FILE *log_fp; } ShedderSession;
+static int shedder_active = 0; //ShedderSession threads running
+
+void *shedder_session(void *arg) {
+    ShedderSession *s = arg;
+    int account_id;
+    if (login_session(s->sock, 0, &account_id) >= 0) serve_session(s->sock, 0, account_id, s->log_fp);
+    free(s);
+    __sync_fetch_and_sub(&shedder_active, 1);
+    return NULL;
+}
+
+/*
+Admission control (-Q): keeps the accept queue at most max_queue deep even while
+every worker is tied up in a session, by rejecting the oldest waiting sessions.
+Workers may drain the queue between the depth check and accept(), so the depth
+is checked again once the session is held; a session that no longer exceeds it
+goes through the same admission check as in a worker and is served on a thread
+of this process, so shedding goes on meanwhile. At most SHEDDER_SESSIONS are
+served this way; past that the session is rejected like a shed one, so the
+shedder never grows into a second worker pool.
+ */
+void shedder_loop(int listen_fd) {
+    signal(SIGINT, SIG_DFL);
+    FILE *log_fp = fopen(log_name, "a");
+    struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+    while (1) {
+        if (!admit_queue_full(&admit_cfg, listen_fd, 0)) { usleep(1000); continue; }
+        //Workers may have drained the queue meanwhile; don't sit in accept if so
+        if (poll(&pfd, 1, 0) <= 0) continue;
+        int sock = accept(listen_fd, NULL, NULL);
+        if (sock < 0) continue;
+
+        //Only this thread starts sessions, so the count cannot grow between check and increment
+        int retry_ms;
+        if (admit_queue_full(&admit_cfg, listen_fd, 1) || shedder_active >= SHEDDER_SESSIONS)
+            retry_ms = admit_reject(bank, sock);
+        else
+            retry_ms = admit_session(bank, &admit_cfg, listen_fd, sock);
+        if (retry_ms > 0) { reject_session(sock, retry_ms); continue; }
+
+        ShedderSession *s = malloc(sizeof(ShedderSession));
+        pthread_t tid;
+        if (s == NULL) { close(sock); continue; }
+        *s = (ShedderSession){ sock, log_fp };
+        __sync_fetch_and_add(&shedder_active, 1);
+        if (pthread_create(&tid, NULL, shedder_session, s) != 0) {
+            __sync_fetch_and_sub(&shedder_active, 1);
+            free(s);
+            close(sock);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+}
+
+/* ================= Replication ================= */
+//Primary side: each sender process streams the change log to one follower at a time
+void repl_sender_loop(int repl_fd) {
+    signal(SIGINT, SIG_DFL);
+    while (1) {
+        int account_id;
+        int sock = accept_session(repl_fd, 1, &account_id);
+        if (sock < 0) continue;
+        print_server_console_log("[REPL] Follower connected");
+        repl_send_stream(bank, sock);
+        print_server_console_log("[REPL] Follower disconnected");
+        close(sock);
+    }
+}
+
+//Follower side: keeps applying the primary's change log, reconnecting after failures,
+//until the parent asks it to stop (SIGTERM on promotion)
+void repl_follower_loop() {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, handle_sigint);
+    while (!stop_server) {
+        int sock = shard_open_session(follow_host, follow_port + REPL_PORT_OFFSET, ADMIN_USERNAME, ADMIN_PASSWORD);
+        if (sock < 0) { sleep(1); continue; }
+        print_server_console_log("[REPL] Following primary %s:%d", follow_host, follow_port);
+        int ret = repl_receive_stream(bank, sock, &stop_server);
+        close(sock);
+        if (ret == -2) {
+            //Serving a copy of a different ledger would be worse than serving none
+            print_server_console_log("[REPL] Primary's accounts differ from this follower's %d..%d "
+                                     "(start it with the primary's -L/-m); shutting down",
+                                     bank->first_id, bank->first_id + bank->num_accounts - 1);
+            kill(getppid(), SIGINT);
+            return;
+        }
+        if (!stop_server) print_server_console_log("[REPL] Lost primary, reconnecting...");
+    }
+}
+
 /* ================= Print Final Bank ================= */
 void print_final_report() {
     printf("\n========== [Mutex Bank 帳戶餘額一覽] ==========\n");
     long long total_assets = 0;
-    for (int i = 0; i < MAX_ACCOUNTS; i++) {
+    for (int i = 0; i < bank->num_accounts; i++) {
+        total_assets += bank->accounts[i].balance;
+        //Large ledgers: only list the first MAX_ACCOUNTS accounts
+        if (i >= MAX_ACCOUNTS) continue;
         if (i % 4 == 0) printf("\n");
         printf("[Acc %02d: $%4lld]  ", bank->accounts[i].id, bank->accounts[i].balance);
-        total_assets += bank->accounts[i].balance;
     }
+    if (bank->num_accounts > MAX_ACCOUNTS)
+        printf("\n... (%d more accounts)", bank->num_accounts - MAX_ACCOUNTS);
     printf("\n-----------------------------------------------\n");
     printf("📊 統計數據:\n");
     printf(" 1. 銀行總資產: $%lld\n", total_assets);
     printf(" 2. 總交易筆數: %lld 筆\n", bank->total_tx_count);
     double avg_latency_ms = bank->total_tx_count > 0 ? (double)bank->total_latency_ns / bank->total_tx_count / 1e6 : 0;
     printf(" 3. 平均延遲: %.3f ms\n", avg_latency_ms);
+    printf(" 4. 複寫序號: %lld (%s, lag %lld)\n", bank->repl_head,
+           bank->read_only ? "follower" : "primary", repl_lag(bank));
+    long long tlb_misses = perf_read(tlb_fd);
+    if (tlb_misses >= 0)
+        printf(" 5. dTLB 未命中: %lld (%.1f / 交易)\n", tlb_misses,
+               bank->total_tx_count > 0 ? (double)tlb_misses / bank->total_tx_count : 0);
+    else
+        printf(" 5. dTLB 未命中: 無法取得 (perf events unavailable)\n");
+    printf(" 6. 過載拒絕: 連線 %lld 次, 請求 %lld 次\n", bank->admit_shed_sessions, bank->admit_shed_requests);
+    printf(" 7. 2PC 未決交易: %d 筆\n", count_in_doubt());
     printf("===============================================\n");
 }
 
-/* ================= Main ================= */
-int main() {
-    signal(SIGINT, handle_sigint);
+/* ================= Transfer Benchmark ================= */
+//In-process benchmark (-B): random transfers across the whole ledger without the
+//network, to expose the memory and TLB cost of the account table itself
+typedef struct { long long transfers; unsigned seed; long long applied; } BenchArg;
+
+void *bench_task(void *arg) {
+    BenchArg *b = arg;
+    int n = bank->num_accounts;
+    for (long long i = 0; i < b->transfers; i++) {
+        Account *src = &bank->accounts[rand_r(&b->seed) % n];
+        Account *dst = &bank->accounts[rand_r(&b->seed) % n];
+        if (src == dst) continue;
+        //Deadlock Prevention: Always lock the smaller ID first
+        Account *first = (src->id < dst->id) ? src : dst;
+        Account *second = (src->id < dst->id) ? dst : src;
+        pthread_mutex_lock(&first->lock);
+        pthread_mutex_lock(&second->lock);
+        if (src->balance >= 1) { src->balance -= 1; dst->balance += 1; b->applied++; }
+        pthread_mutex_unlock(&second->lock);
+        pthread_mutex_unlock(&first->lock);
+    }
+    return NULL;
+}
+
+void run_transfer_benchmark(long long transfers) {
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t tids[threads];
+    BenchArg args[threads];
+    int fd = perf_tlb_open(1);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int t = 0; t < threads; t++) {
+        args[t] = (BenchArg){ transfers / threads, (unsigned)t * 7919 + 1, 0 };
+        pthread_create(&tids[t], NULL, bench_task, &args[t]);
+    }
+    for (int t = 0; t < threads; t++) pthread_join(tids[t], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long long misses = perf_read(fd);
+    if (fd >= 0) close(fd);
+
+    //Rates use the transfers actually applied (self-transfers and empty accounts are skipped)
+    long long applied = 0;
+    for (int t = 0; t < threads; t++) applied += args[t].applied;
+    double sec = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("\n========== [轉帳基準測試] ==========\n");
+    printf("帳戶數: %d, 執行緒: %d, 轉帳: %lld (實際完成 %lld)\n", bank->num_accounts, threads, transfers, applied);
+    printf("耗時: %.3f 秒, Throughput: %.0f 轉帳/秒\n", sec, sec > 0 ? applied / sec : 0);
+    if (misses >= 0) printf("dTLB 未命中: %lld (%.3f / 轉帳)\n", misses, applied > 0 ? (double)misses / applied : 0);
+    else printf("dTLB 未命中: 無法取得 (perf events unavailable)\n");
+    printf("====================================\n");
+}
+
+/* ================= Child Processes ================= */
+//Forks a child running fn(arg) and remembers its pid
+pid_t spawn_child(void (*fn)(int), int arg) {
+    pid_t pid = fork();
+    if (pid == 0) { fn(arg); exit(0); }
+    if (pid > 0) children[num_children++] = pid;
+    return pid;
+}
 
-    init_bank();
+//Stops every child so the ledger no longer changes
+void stop_children() {
+    for (int i = 0; i < num_children; i++) kill(children[i], SIGTERM);
+    for (int i = 0; i < num_children; i++) waitpid(children[i], NULL, 0);
+    num_children = 0;
+}
 
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
+/* ================= Listener ================= */
+//Creates a TCP socket listening on the given port
+int open_listener(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
     struct sockaddr_in serv_addr = {
         .sin_family = AF_INET,
-        .sin_port = htons(PORT),
+        .sin_port = htons(port),
         .sin_addr.s_addr = INADDR_ANY
     };
     int opt = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    if (bind(server_fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) { perror("Bind"); exit(1); }
-    listen(server_fd, 100);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (bind(fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) { perror("Bind"); exit(1); }
+    //Deep accept queue: the event-driven client opens thousands of sessions at once,
+    //and a full queue silently drops handshakes instead of queueing them
+    listen(fd, SOMAXCONN);
+    return fd;
+}
 
-    //Preforking: Create 10 child processes to handle connections
-    for (int i = 0; i < 10; i++) {
-        if (fork() == 0) { worker_loop(server_fd); exit(0); }
+/* ================= Main ================= */
+int main(int argc, char *argv[]) {
+    //Parse configuration: -m <shard map> -i <index of this shard in the map>
+    //-f <primary host:port> runs as a read-only follower, -p <port> overrides the listen port
+    //-Q <depth> / -W <ms> shed sessions past that accept-queue depth / average queue wait,
+    //-r <n> limits each account to n requests per second
+    const char *map_spec = DEFAULT_SHARD_MAP;
+    int port = 0;
+    int c;
+    const char *trace_path = NULL;
+    const char *account_file = NULL;
+    int huge_pages = 0;
+    long long bench_transfers = 0;
+    int map_given = 0;
+    while ((c = getopt(argc, argv, "m:i:f:p:T:L:HB:Q:W:r:")) != -1) {
+        switch (c) {
+            case 'm': map_spec = optarg; map_given = 1; break;
+            case 'i': shard_idx = atoi(optarg); break;
+            case 'f':
+                if (sscanf(optarg, "%63[^:]:%d", follow_host, &follow_port) != 2) follow_port = -1;
+                break;
+            case 'p': port = atoi(optarg); break;
+            case 'T': trace_path = optarg; break;
+            case 'L': account_file = optarg; break;
+            case 'H': huge_pages = 1; break;
+            case 'B': bench_transfers = atoll(optarg); break;
+            case 'Q': admit_cfg.max_queue = atoi(optarg); break;
+            case 'W': admit_cfg.max_wait_ms = atoi(optarg); break;
+            case 'r': admit_cfg.rate = atoi(optarg); break;
+            default: break;
+        }
     }
+    if (shard_map_parse(&shard_map, map_spec) != 0 || shard_idx < 0 || shard_idx >= shard_map.n ||
+        follow_port < 0) {
+        fprintf(stderr, "Usage: %s [-m host:port:first:count,...] [-i shard_index] "
+                        "[-f primary_host:port] [-p port] [-T trace_file] "
+                        "[-L account_file] [-H] [-B transfers] [-Q max_queue] [-W max_wait_ms] "
+                        "[-r requests_per_sec]\n", argv[0]);
+        exit(1);
+    }
+    //Cross-shard transfers authenticate to the other shards with a secret shared by the
+    //servers only, so a client cannot forge the credit half of a transfer
+    const char *secret = getenv(PEER_SECRET_ENV);
+    if (secret && strlen(secret) >= sizeof(peer_secret)) {
+        fprintf(stderr, "%s must be at most %zu characters\n", PEER_SECRET_ENV, sizeof(peer_secret) - 1);
+        exit(1);
+    }
+    if (secret) strcpy(peer_secret, secret);
+    if (shard_map.n > 1 && peer_secret[0] == '\0') {
+        fprintf(stderr, "A multi-shard map needs the shard-to-shard secret: set %s on every server\n", PEER_SECRET_ENV);
+        exit(1);
+    }
+    if (port == 0) port = shard_map.shards[shard_idx].port;
+    shard_map.shards[shard_idx].port = port;
+
+    //Shards and followers sharing a host need their own shared memory segment and log
+    if (follow_port) {
+        snprintf(shm_name, sizeof(shm_name), "%s_replica_%d", SHM_NAME, port);
+        snprintf(log_name, sizeof(log_name), "transaction_replica_%d.log", port);
+    } else if (shard_map.n > 1) {
+        snprintf(shm_name, sizeof(shm_name), "%s_%d", SHM_NAME, shard_idx);
+        snprintf(log_name, sizeof(log_name), "transaction_%d.log", shard_idx);
+    }
+
+    signal(SIGINT, handle_sigint);
+    signal(SIGUSR1, handle_sigusr1);
+    //A peer or follower closing its socket must not kill the process writing to it
+    signal(SIGPIPE, SIG_IGN);
 
-    //Parent process waits for signal to stop
-    while (!stop_server) pause();
+    //Without a shard map, a bulk-loaded ledger takes its account range from the file
+    if (account_file && !map_given) shard_map.shards[shard_idx].count = 0;
+    init_bank(account_file, huge_pages);
+
+    if (bench_transfers > 0) {
+        run_transfer_benchmark(bench_transfers);
+        shm_unlink(shm_name);
+        return 0;
+    }
+
+    server_fd = open_listener(port);
+    peer_fd = open_listener(port + PEER_PORT_OFFSET);
+    repl_fd = open_listener(port + REPL_PORT_OFFSET);
+
+    //Capture mode: record every client request for later replay
+    if (trace_path) {
+        trace_fd = trace_open(trace_path, bank);
+        if (trace_fd < 0) { perror("trace_open"); exit(1); }
+        print_server_console_log("Capturing workload trace to %s", trace_path);
+    }
+    if (admit_cfg.max_queue > 0 || admit_cfg.max_wait_ms > 0 || admit_cfg.rate > 0)
+        print_server_console_log("Admission control: max queue %d, max wait %d ms, %d req/s per account (0 = off)",
+                                 admit_cfg.max_queue, admit_cfg.max_wait_ms, admit_cfg.rate);
+
+    //Followers serve reads only, until promoted with SIGUSR1
+    pid_t follower_pid = 0;
+    if (follow_port) {
+        bank->read_only = 1;
+        print_server_console_log("Read-only follower of %s:%d (promote with kill -USR1 %d)",
+                                 follow_host, follow_port, getpid());
+        follower_pid = fork();
+        if (follower_pid == 0) { repl_follower_loop(); exit(0); }
+    }
+
+    //Count dTLB misses of every process from here on (children inherit the counter)
+    tlb_fd = perf_tlb_open(1);
+
+    //Preforking: Create 10 child processes to handle connections
+    for (int i = 0; i < WORKER_PROCESSES; i++) spawn_child(worker_loop_users, server_fd);
+    if (admit_cfg.max_queue > 0) spawn_child(shedder_loop, server_fd);
+    //Separate workers for peer traffic, so a shard busy coordinating 2PC
+    //can never starve the participants its peers are waiting on
+    for (int i = 0; i < PEER_WORKERS; i++) spawn_child(worker_loop_peers, peer_fd);
+    //Every server (primary or follower) can feed followers of its own
+    for (int i = 0; i < REPL_SENDERS; i++) spawn_child(repl_sender_loop, repl_fd);
+
+    //Parent process waits for signal to stop (or to promote this follower)
+    while (!stop_server) {
+        pause();
+        if (promote_requested && follower_pid > 0) {
+            //Stop applying the old primary's stream, then start accepting writes
+            kill(follower_pid, SIGTERM);
+            waitpid(follower_pid, NULL, 0);
+            follower_pid = 0;
+            bank->read_only = 0;
+            print_server_console_log("[REPL] Promoted to primary at seq %lld", bank->repl_head);
+        }
+        promote_requested = 0;
+    }
 
+    if (follower_pid > 0) { kill(follower_pid, SIGTERM); waitpid(follower_pid, NULL, 0); }
+    stop_children();
     print_final_report();
-    shm_unlink(SHM_NAME);
+    if (trace_fd >= 0 && trace_finish(trace_fd, bank) == 0)
+        print_server_console_log("Workload trace saved with final balances");
+    shm_unlink(shm_name);
     close(server_fd);
+    close(peer_fd);
+    close(repl_fd);
     return 0;
 }
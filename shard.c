@@ -0,0 +1,125 @@
+#include "shard.h"
+#include "protocol.h"
+#include "security.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/*
+Parses a shard map of the form "host:port:first_id:count[,host:port:first_id:count...]".
+Every server and client in a deployment must be given the same map.
+Returns 0 on success, -1 if the spec is malformed or ranges overlap.
+ */
+int shard_map_parse(ShardMap *map, const char *spec) {
+    char buf[1024];
+    snprintf(buf, sizeof(buf), "%s", spec);
+    map->n = 0;
+
+    char *save = NULL;
+    for (char *tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (map->n >= MAX_SHARDS) return -1;
+        ShardInfo *s = &map->shards[map->n];
+        if (sscanf(tok, "%63[^:]:%d:%d:%d", s->host, &s->port, &s->first_id, &s->count) != 4)
+            return -1;
+        if (s->count <= 0 || s->count > MAX_LEDGER_ACCOUNTS || s->first_id < 0) return -1;
+        //Reject overlapping ranges: every account must have exactly one owner
+        for (int i = 0; i < map->n; i++) {
+            ShardInfo *o = &map->shards[i];
+            if (s->first_id < o->first_id + o->count && o->first_id < s->first_id + s->count)
+                return -1;
+        }
+        map->n++;
+    }
+    return map->n > 0 ? 0 : -1;
+}
+
+//Returns the index of the shard owning account 'id', or -1 if no shard owns it
+int shard_for_account(const ShardMap *map, int id) {
+    for (int i = 0; i < map->n; i++) {
+        if (id >= map->shards[i].first_id && id < map->shards[i].first_id + map->shards[i].count)
+            return i;
+    }
+    return -1;
+}
+
+//Total number of accounts covered by the map
+int shard_map_total(const ShardMap *map) {
+    int total = 0;
+    for (int i = 0; i < map->n; i++) total += map->shards[i].count;
+    return total;
+}
+
+//Maps an index over all accounts of the map (0 .. total-1) to an account ID,
+//so callers never assume IDs start at 0 or have no gaps. Returns -1 if out of range.
+int shard_nth_account(const ShardMap *map, int n) {
+    for (int i = 0; i < map->n; i++) {
+        if (n < map->shards[i].count) return map->shards[i].first_id + n;
+        n -= map->shards[i].count;
+    }
+    return -1;
+}
+
+/*
+Client library entry point: connects to a shard and performs the AES login.
+Returns the connected socket, -1 if the connection failed, -2 if login was rejected,
+or -3 if the server shed the session because it is overloaded (RES_BUSY).
+ */
+int shard_open_session(const char *host, int port, const char *username, const char *password) {
+    struct sockaddr_in serv_addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    if (inet_pton(AF_INET, host, &serv_addr.sin_addr) != 1) return -1;
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    if (connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    //Same keep-alive and timeout policy as the stress client
+    int keep = 1;
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &keep, sizeof(keep));
+    int idle = 5, interval = 3, maxpkt = 3;
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &maxpkt, sizeof(maxpkt));
+    struct timeval tv = {3, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    //Login Phase (AES)
+    LoginRequest login_req = {0};
+    snprintf(login_req.username, LOGIN_USERNAME_LEN, "%s", username);
+    snprintf(login_req.password, LOGIN_PASSWORD_LEN, "%s", password);
+    unsigned char enc_login_req[sizeof(LoginRequest)] = {0};
+    aes_encrypt(&login_req, enc_login_req, sizeof(LoginRequest));
+    if (send_packet(sock, enc_login_req, sizeof(LoginRequest)) != 0) { close(sock); return -1; }
+
+    unsigned char enc_login_res[sizeof(LoginResponse)] = {0};
+    int ret = recv_packet(sock, enc_login_res, sizeof(LoginResponse));
+    LoginResponse login_res = {0};
+    aes_decrypt(enc_login_res, &login_res, sizeof(LoginResponse));
+    if (ret <= 0 || login_res.success != 1) {
+        close(sock);
+        return ret > 0 && login_res.retry_after_ms > 0 ? -3 : -2;
+    }
+
+    return sock;
+}
+
+/*
+Sends one Request on an open session and waits for its Response (XOR on the wire).
+'req' is left in plaintext. Returns 0 on success, -1 on send/receive failure.
+ */
+int shard_call(int sock, Request *req, Response *res) {
+    Request wire = *req;
+    xor_cipher(&wire, sizeof(Request));
+    if (send_packet(sock, &wire, sizeof(Request)) != 0) return -1;
+    if (recv_packet(sock, res, sizeof(Response)) <= 0) return -1;
+    xor_cipher(res, sizeof(Response));
+    return 0;
+}
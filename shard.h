@@ -0,0 +1,12 @@
+#ifndef SHARD_H
+#define SHARD_H
+#include "models.h"
+
+int shard_map_parse(ShardMap *map, const char *spec);
+int shard_for_account(const ShardMap *map, int id);
+int shard_map_total(const ShardMap *map);
+int shard_nth_account(const ShardMap *map, int n);
+int shard_open_session(const char *host, int port, const char *username, const char *password);
+int shard_call(int sock, Request *req, Response *res);
+
+#endif
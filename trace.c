@@ -0,0 +1,100 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+//Writes the balance of every account, in ID order
+static int write_balances(int fd, Bank *bank) {
+    for (int i = 0; i < bank->num_accounts; i++) {
+        if (write(fd, &bank->accounts[i].balance, sizeof(long long)) != sizeof(long long)) return -1;
+    }
+    return 0;
+}
+
+/*
+Creates a trace file and writes its header and the starting balances, so a
+replay can check it runs against the same ledger. Call before any worker starts.
+The file is opened with O_APPEND so every worker process can share the
+descriptor: each record is a single write(), which the kernel appends atomically.
+Returns the file descriptor, or -1 on error.
+ */
+int trace_open(const char *path, Bank *bank) {
+    int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY | O_APPEND, 0644);
+    if (fd < 0) return -1;
+    TraceHeader hdr = {0};
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.first_id = bank->first_id;
+    hdr.num_accounts = bank->num_accounts;
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || write_balances(fd, bank) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//Appends one decoded request (best effort: capture must never fail a transaction)
+void trace_write(int fd, const TraceRecord *rec) {
+    if (write(fd, rec, sizeof(*rec)) != sizeof(*rec)) perror("trace write");
+}
+
+/*
+Closes a capture: appends the final balance of every account and records
+its offset in the header. Call only after every worker has stopped.
+ */
+int trace_finish(int fd, Bank *bank) {
+    //pwrite() ignores the offset on O_APPEND descriptors, so turn it off first
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_APPEND);
+    long long offset = lseek(fd, 0, SEEK_END);
+    if (write_balances(fd, bank) != 0) return -1;
+    if (pwrite(fd, &offset, sizeof(offset), offsetof(TraceHeader, final_offset)) != sizeof(offset)) return -1;
+    return close(fd);
+}
+
+//Reads num_accounts balances at 'offset'. Returns them (caller frees), or NULL on error.
+static long long *read_balances(FILE *fp, long offset, int num_accounts) {
+    long long *balances = malloc(num_accounts * sizeof(long long));
+    fseek(fp, offset, SEEK_SET);
+    if (fread(balances, sizeof(long long), num_accounts, fp) != (size_t)num_accounts) {
+        free(balances);
+        return NULL;
+    }
+    return balances;
+}
+
+/*
+Loads a whole trace into memory with the starting balances ('*initial_balances').
+'*final_balances' is set to NULL if the capture was not finished cleanly.
+Returns the records (caller frees), or NULL on error.
+ */
+TraceRecord *trace_load(const char *path, TraceHeader *hdr, long long **initial_balances,
+                        long long **final_balances, long *count) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return NULL;
+    if (fread(hdr, sizeof(*hdr), 1, fp) != 1 || memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->num_accounts <= 0) {
+        fclose(fp);
+        return NULL;
+    }
+    long start = sizeof(*hdr) + (long)hdr->num_accounts * sizeof(long long);
+    *initial_balances = read_balances(fp, sizeof(*hdr), hdr->num_accounts);
+    if (!*initial_balances) { fclose(fp); return NULL; }
+
+    fseek(fp, 0, SEEK_END);
+    long end = hdr->final_offset ? hdr->final_offset : ftell(fp);
+    *count = (end - start) / (long)sizeof(TraceRecord);
+    TraceRecord *recs = malloc((*count + 1) * sizeof(TraceRecord));
+    fseek(fp, start, SEEK_SET);
+    if (fread(recs, sizeof(TraceRecord), *count, fp) != (size_t)*count) {
+        free(recs);
+        free(*initial_balances);
+        fclose(fp);
+        return NULL;
+    }
+
+    *final_balances = hdr->final_offset ? read_balances(fp, hdr->final_offset, hdr->num_accounts) : NULL;
+    fclose(fp);
+    return recs;
+}
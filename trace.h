@@ -0,0 +1,11 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include "models.h"
+
+int trace_open(const char *path, Bank *bank);
+void trace_write(int fd, const TraceRecord *rec);
+int trace_finish(int fd, Bank *bank);
+TraceRecord *trace_load(const char *path, TraceHeader *hdr, long long **initial_balances,
+                        long long **final_balances, long *count);
+
+#endif